@@ -9,68 +9,270 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
 #include <malloc.h>
 #include <time.h>
-#include <float.h>
-
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <math.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/mount.h>
 #include <sys/uio.h>
+#include <sys/vfs.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_LINUX_AIO_ABI_H
+#include <linux/aio_abi.h>
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
 
-#include <openssl/sha.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define __maybe_unused		__attribute__((unused))
 
 #define false	0
 #define true	!false
 
-/* for measuring throughput */
-static struct timespec		start;
-static struct timespec		end;
-
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+/* largest SG list a single request may carry */
+#define MSC_MAX_SEGMENTS	128
+
+/* devices tested at once, one --output each */
+#define MSC_MAX_OUTPUTS		16
+
+struct usb_msc_test;
+struct msc_logger;
+
+/**
+ * struct msc_io - one request handled by a queued I/O engine
+ * @iov:	segments pointing into this slot's tx or rx buffer
+ * @iovcnt:	number of valid entries in @iov
+ * @offset:	byte offset on the device
+ * @len:	total request length
+ * @slot:	index of the buffer slot this request owns
+ * @write:	true for writes, false for reads
+ * @generation:	generation stamped by the write
+ * @busy:	a write that owns [@offset, @offset + @len) until it has
+ *		been read back and verified
+ * @result:	bytes transferred or negative errno, filled on completion
+ * @start:	submission timestamp
+ */
+struct msc_io {
+	struct iovec	iov[MSC_MAX_SEGMENTS];
+	unsigned	iovcnt;
+	off_t		offset;
+	unsigned	len;
+	unsigned	slot;
+	unsigned	write;
+	uint64_t	generation;
+	unsigned	busy;
+	int		result;
+	struct timespec	start;
+};
+
+/**
+ * struct msc_engine - an I/O engine
+ * @name:	name used with --engine
+ * @init:	set up engine private data, called after the device is open
+ * @exit:	tear down engine private data
+ * @queue:	stage @io for submission
+ * @commit:	hand every staged request to the kernel
+ * @getevents:	wait for at least @min completions, return up to @max of
+ *		them in @ios
+ *
+ * Engines without a @queue method use the synchronous read()/write()
+ * path implemented by each test case.
+ */
+struct msc_engine {
+	const char	*name;
+	int		(*init)(struct usb_msc_test *msc);
+	void		(*exit)(struct usb_msc_test *msc);
+	int		(*queue)(struct usb_msc_test *msc, struct msc_io *io);
+	int		(*commit)(struct usb_msc_test *msc);
+	int		(*getevents)(struct usb_msc_test *msc, unsigned min,
+				struct msc_io **ios, unsigned max);
+};
+
+/*
+ * Latency histogram: MSC_HIST_SUB linear buckets per power of two,
+ * covering up to 2^39 ns (about 9 minutes) with under 3% error.
+ */
+#define MSC_HIST_SUB_BITS	5
+#define MSC_HIST_SUB		(1 << MSC_HIST_SUB_BITS)
+#define MSC_HIST_BUCKETS	((39 - MSC_HIST_SUB_BITS + 2) * MSC_HIST_SUB)
+
+/**
+ * struct msc_stats - per direction statistics
+ * @ios:	completed requests
+ * @bytes:	bytes moved
+ * @min:	fastest request, in ns
+ * @max:	slowest request, in ns
+ * @last:	latency of the most recent request, in ns
+ * @last_bytes:	size of the most recent request
+ * @hist:	latency histogram, see hist_index()
+ */
+struct msc_stats {
+	uint64_t	ios;
+	uint64_t	bytes;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	last;
+	uint64_t	last_bytes;
+	uint64_t	hist[MSC_HIST_BUCKETS];
+};
+
+/* what a test cost the host, see cpu_start() */
+enum msc_cpu_counter {
+	MSC_CPU_CLOCK = 0,		/* task clock, ns */
+	MSC_CPU_CYCLES,
+	MSC_CPU_INSNS,			/* instructions retired */
+	MSC_CPU_CSW,			/* context switches */
+	MSC_CPU_FAULTS,			/* page faults */
+	MSC_CPU_COUNTERS,
+};
+
+/**
+ * struct msc_cpu - CPU accounting of one test
+ * @fd:		perf event per counter, -1 where perf isn't available
+ * @ru:		rusage when the test started
+ * @val:	counter values once the test is over
+ * @valid:	bitmask of the counters in @val which could be measured
+ */
+struct msc_cpu {
+	int		fd[MSC_CPU_COUNTERS];
+	struct rusage	ru;
+	uint64_t	val[MSC_CPU_COUNTERS];
+	unsigned	valid;
+};
+
+enum msc_dist {
+	MSC_DIST_UNIFORM = 0,		/* every block equally likely */
+	MSC_DIST_ZIPF,			/* zipf(theta) hot set */
+};
+
+enum msc_io_mode {
+	MSC_IO_DIRECT = 0,		/* O_DIRECT, around the page cache */
+	MSC_IO_BUFFERED,		/* through the page cache */
+	MSC_IO_MMAP,			/* memcpy() to and from a shared mapping */
+};
+
+struct msc_advice;
+
+/* zipf sampler state, see zipf_init() */
+struct msc_zipf {
+	double		theta;
+	uint64_t	n;
+	double		hx1;
+	double		hn;
+	double		s;
+};
 
 struct usb_msc_test {
 	uint64_t	transferred;	/* amount of data transferred so far */
 	uint64_t	psize;		/* partition size */
-	uint64_t	pempty;		/* what needs to be filled up still */
-
-	float		read_tput_instant; /* read throughput */
-	float		read_tput_old;	/* previous read throughput */
-	float		read_min;	/* read throughput */
-	float		read_max;	/* read throughput */
-	float		read_tput;	/* read throughput */
-	float		read_var;	/* read variance */
-	unsigned long long read_count;
-
-	float		write_tput_instant; /* write throughput */
-	float		write_tput_old;	/* previous write throughput */
-	float		write_min;	/* write throughput */
-	float		write_max;	/* write throughput */
-	float		write_tput;	/* write throughput */
-	float		write_var;	/* write variance */
-	unsigned long long write_count;
+	uint64_t	base;		/* first byte of this job's slice */
+	uint64_t	span;		/* size of this job's slice */
+
+	/* for measuring throughput */
+	struct timespec	start;
+	struct timespec	end;
+
+	struct msc_stats read;		/* read statistics */
+	struct msc_stats write;		/* write statistics */
+	struct msc_stats discard;	/* discard statistics */
+	struct msc_cpu	cpu;		/* what the last test cost the host */
+
+	struct timespec	begin;		/* test started */
+	uint64_t	elapsed;	/* test duration, in ns */
 
 	int		fd;		/* /dev/sd?? */
+	int		regular;	/* target is a regular file */
+	int		direct;		/* O_DIRECT in effect */
+	enum msc_io_mode io_mode;	/* --io-mode */
+	const struct msc_advice *advice; /* --advise, or NULL */
+	unsigned char	*map;		/* --io-mode=mmap mapping of the target */
+	int		populate;	/* MAP_POPULATE the mapping */
+	int		msync_writes;	/* msync() every mmap write */
 	int		count;		/* iteration count */
 
 	unsigned	sect_size;	/* sector size */
 	unsigned	pattern;	/* pattern to use */
 	unsigned	size;		/* buffer size */
 
-	off_t		offset;		/* current offset */
+	off_t		wr_offset;	/* where the last write started */
+	uint64_t	generation;	/* generation of the last write */
+	uint64_t	next;		/* next write offset */
+	int		rwf;		/* RWF_* flags passed with every I/O */
+	uint64_t	eagain;		/* RWF_NOWAIT requests retried */
 
 	unsigned char	*txbuf;		/* send buffer */
-	unsigned char	*rxbuf;		/* receive buffer*/
+	unsigned char	*rxbuf;		/* receive buffer, same as txbuf */
+	unsigned	fill;		/* MSC_FILL_PRNG or pattern byte */
 	char		*output;	/* writing to... */
 
+	int		random;		/* random instead of sequential offsets */
+	enum msc_dist	dist;		/* random offset distribution */
+	double		theta;		/* zipf skew */
+	uint64_t	rnd_span;	/* bytes eligible for random I/O */
+	uint64_t	seed;		/* random seed */
+	uint64_t	rng;		/* PRNG state */
+	struct msc_zipf	zipf;		/* zipf sampler, n is the block count */
+
+	const struct msc_engine *engine; /* I/O engine */
+	void		*engine_data;	/* engine private data */
+	struct msc_io	*ios;		/* one request per slot */
+	struct msc_io	**events;	/* completions returned by engine */
+	unsigned	iodepth;	/* requests kept in flight */
+	unsigned	verify_pool;	/* slots owned by the verify stage */
+	unsigned	slots;		/* buffer slots, iodepth + verify_pool */
+	int		hugepages;	/* --hugepages buffer pool */
+	size_t		mapped;		/* pool length if mmap()ed, else 0 */
+	unsigned	batch;		/* minimum completions per reap */
+	unsigned	stride;		/* distance between buffer slots */
+	unsigned	segments;	/* --sweep-sg: equal segments per request */
+
+	uint64_t	runtime;	/* stop starting iterations after, ns */
+	uint64_t	rate_bps;	/* --rate in bytes per second */
+	uint64_t	rate_iops;	/* --rate in I/Os per second */
+	uint64_t	tat;		/* when the token bucket refills, ns */
+	int		*stop;		/* shared by --output workers, or NULL */
+	int		precondition;	/* fill the target before testing */
+	uint64_t	discard_offset;	/* --discard-offset, bytes */
+	int		verify_zeroes;	/* read back discarded ranges */
+	unsigned	rwmix;		/* --rwmix, percent of reads */
+	unsigned	read_size;	/* --rwmix read size */
+	unsigned	write_size;	/* --rwmix write size */
+	uint64_t	ss_max;		/* --steady-state limit, ns, or 0 */
+
+	struct msc_logger *logger;	/* --log, NULL without */
+	uint64_t	reported;	/* progress last drawn, ns */
+
 	int		variance;	/* show throughput variance */
 	int		verbose;	/* enable verbose output */
+	int		quiet;		/* no per-iteration progress */
 };
 
 enum usb_msc_test_case {
@@ -93,6 +295,12 @@ enum usb_msc_test_case {
 	MSC_RESERVED0,
 	MSC_RESERCED1,
 	MSC_TEST_PATTERNS,		/* write known patterns and read it back */
+	MSC_TEST_RANDOM,		/* write, read, verify at random offsets */
+	MSC_TEST_DISCARD,		/* BLKDISCARD --size bytes at a time */
+	MSC_TEST_SECDISCARD,		/* BLKSECDISCARD --size bytes at a time */
+	MSC_TEST_ZEROOUT,		/* BLKZEROOUT --size bytes at a time */
+	MSC_TEST_DISCARD_WRITE,		/* discard, then write, read, verify */
+	MSC_TEST_RWMIX,			/* independent random reads and writes */
 };
 
 /* Patterns taken from linux/arch/x86/mm/memtest.c */
@@ -120,20 +328,11 @@ static char units[] = {
 	'Y',
 };
 
-/**
- * init_buffer - initializes our TX buffer with known data
- * @buf:	Buffer to initialize
- */
-static void init_buffer(struct usb_msc_test *msc)
-{
-	memset(msc->txbuf, 0x55, msc->size);
-}
-
 /**
  * alloc_buffer - allocates a @size buffer
  * @size:	Size of buffer
  */
-static unsigned char *alloc_buffer(unsigned size)
+static unsigned char *alloc_buffer(size_t size)
 {
 	void			*tmp;
 	int			ret;
@@ -148,108 +347,269 @@ static unsigned char *alloc_buffer(unsigned size)
 	return tmp;
 }
 
+/* PMD size huge pages, 2M on x86_64 and on arm64 with 4k pages */
+#define MSC_HUGEPAGE_SIZE	(2UL << 20)
+
+/**
+ * alloc_huge_buffer - allocates a @size buffer backed by huge pages
+ * @msc:	Mass Storage Test Context, @msc->mapped set to the length
+ * @size:	Size of buffer
+ *
+ * With 4k pages every O_DIRECT request pins and maps one page per 4k,
+ * which is what limits large requests on the host side. MAP_HUGETLB
+ * needs pages reserved in vm.nr_hugepages, without them we fall back to
+ * a 2M aligned mapping and ask for transparent huge pages.
+ */
+static unsigned char *alloc_huge_buffer(struct usb_msc_test *msc,
+		size_t size)
+{
+	size_t			len;
+	uintptr_t		start;
+	uintptr_t		aligned;
+	void			*tmp;
+
+	len = (size + MSC_HUGEPAGE_SIZE - 1) & ~(MSC_HUGEPAGE_SIZE - 1);
+
+	tmp = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (tmp != MAP_FAILED) {
+		msc->mapped = len;
+		return tmp;
+	}
+
+	/* over-allocate, then trim so the mapping starts on a huge page */
+	tmp = mmap(NULL, len + MSC_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (tmp == MAP_FAILED)
+		return NULL;
+
+	start = (uintptr_t) tmp;
+	aligned = (start + MSC_HUGEPAGE_SIZE - 1) & ~(MSC_HUGEPAGE_SIZE - 1);
+
+	if (aligned > start)
+		munmap(tmp, aligned - start);
+	munmap((void *) (aligned + len), start + MSC_HUGEPAGE_SIZE - aligned);
+
+	if (madvise((void *) aligned, len, MADV_HUGEPAGE) < 0)
+		fprintf(stderr, "hugepages: no hugetlb pages and no THP: %s\n",
+				strerror(errno));
+
+	msc->mapped = len;
+
+	return (unsigned char *) aligned;
+}
+
+/* releases what alloc_and_init_buffer() got */
+static void free_buffer(struct usb_msc_test *msc)
+{
+	if (msc->mapped)
+		munmap(msc->txbuf, msc->mapped);
+	else
+		free(msc->txbuf);
+
+	msc->txbuf = NULL;
+	msc->rxbuf = NULL;
+	msc->mapped = 0;
+}
+
 /**
- * alloc_and_init_buffer - Allocates and initializes both buffers
+ * alloc_and_init_buffer - Allocates and initializes the buffer
  * @msc:	Mass Storage Test Context
+ *
+ * Data read back is checked against the generator, not against a copy
+ * of what was written, so reads land in the same memory writes came
+ * from and rxbuf is just another name for txbuf. That one pool holds
+ * the slots of every I/O and verify stage, so --hugepages covers all of
+ * them.
  */
 static int alloc_and_init_buffer(struct usb_msc_test *msc)
 {
-	int			ret = -ENOMEM;
+	unsigned		pagesize = getpagesize();
+	size_t			size;
 
-	msc->txbuf = alloc_buffer(msc->size);
-	if (!msc->txbuf)
-		goto err0;
+	/* each in-flight request owns one page aligned slot */
+	msc->stride = (msc->size + pagesize - 1) & ~(pagesize - 1);
+	size = (size_t) msc->stride * msc->slots;
 
-	init_buffer(msc);
+	msc->mapped = 0;
 
-	msc->rxbuf = alloc_buffer(msc->size);
-	if (!msc->rxbuf)
-		goto err1;
+	if (msc->hugepages)
+		msc->txbuf = alloc_huge_buffer(msc, size);
+	else
+		msc->txbuf = alloc_buffer(size);
+	if (!msc->txbuf)
+		return -ENOMEM;
+
+	memset(msc->txbuf, 0x00, size);
+	msc->rxbuf = msc->txbuf;
 
 	return 0;
+}
 
-err1:
-	free(msc->txbuf);
+static uint64_t timespec_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
 
-err0:
-	return ret;
+static uint64_t now_ns(void)
+{
+	struct timespec		now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* MB/s for @size bytes moved in @ns nanoseconds */
+static double throughput(uint64_t size, uint64_t ns)
+{
+	if (!ns)
+		return 0;
+
+	return (double) size * 1000000000.0 / ((double) ns * 1024 * 1024);
 }
 
-static float throughput(struct timespec *start, struct timespec *end, size_t size)
+/**
+ * hist_index - map a latency to its histogram bucket
+ * @ns:		latency in nanoseconds
+ *
+ * Latencies below MSC_HIST_SUB land in their own bucket. Above that,
+ * every power of two is split in MSC_HIST_SUB linear buckets, which
+ * keeps the relative error under 1 / MSC_HIST_SUB at any magnitude.
+ */
+static unsigned hist_index(uint64_t ns)
 {
-	int64_t diff;
+	unsigned		msb;
+	unsigned		index;
+
+	if (ns < MSC_HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	index = (msb - MSC_HIST_SUB_BITS + 1) * MSC_HIST_SUB +
+		((ns >> (msb - MSC_HIST_SUB_BITS)) & (MSC_HIST_SUB - 1));
 
-	diff = (end->tv_sec - start->tv_sec) * 1000000000;
-	diff += end->tv_nsec - start->tv_nsec;
+	if (index >= MSC_HIST_BUCKETS)
+		index = MSC_HIST_BUCKETS - 1;
 
-	return (float) size / ((diff / 1000000000.0) * 1024 * 1024);
+	return index;
 }
 
-static float throughput_mean(float tput, float mean, int n)
+/* midpoint of the latency range covered by bucket @index */
+static uint64_t hist_value(unsigned index)
 {
-	return mean + (tput - mean) / n;
+	unsigned		group = index / MSC_HIST_SUB;
+	unsigned		sub = index % MSC_HIST_SUB;
+
+	if (group == 0)
+		return sub;
+
+	return ((uint64_t) (MSC_HIST_SUB + sub) << (group - 1)) +
+		((1ULL << (group - 1)) >> 1);
 }
 
-static float throughput_var(float var, float tput, float old_mean, float mean, int n)
+/**
+ * stats_percentile - latency below which @pct percent of requests fall
+ * @st:		statistics of one direction
+ * @pct:	percentile, 0 - 100
+ */
+static uint64_t stats_percentile(struct msc_stats *st, double pct)
 {
-	float term1;
-	float term2;
+	uint64_t		target;
+	uint64_t		seen = 0;
+	unsigned int		i;
+
+	if (!st->ios)
+		return 0;
+
+	target = (uint64_t) (st->ios * pct / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < MSC_HIST_BUCKETS; i++) {
+		seen += st->hist[i];
+		if (seen >= target)
+			break;
+	}
 
-	term1 = (n - 1) * var / n;
-	term2 = (tput - old_mean) * (tput - mean) / n;
+	/* the bucket midpoint may overshoot what was really observed */
+	if (hist_value(i) > st->max)
+		return st->max;
 
-	return term1 + term2;
+	return hist_value(i);
 }
 
-static void collect_data(struct usb_msc_test *msc, struct timespec *start,
-		struct timespec *end, size_t size, unsigned int write)
+/*
+ * Only the I/O thread writes @st. The counters --log samples are stored
+ * atomically, which costs nothing over a plain store but keeps the
+ * logger thread from ever seeing half of one.
+ */
+static void stats_add(struct msc_stats *st, uint64_t ns, size_t size)
+{
+	unsigned		index = hist_index(ns);
+
+	if (!st->ios || ns < st->min)
+		st->min = ns;
+	if (ns > st->max)
+		__atomic_store_n(&st->max, ns, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&st->ios, st->ios + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->bytes, st->bytes + size, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->hist[index], st->hist[index] + 1,
+			__ATOMIC_RELAXED);
+	st->last = ns;
+	st->last_bytes = size;
+}
+
+static void stats_merge(struct msc_stats *dst, struct msc_stats *src)
 {
-	float			tput;
+	unsigned int		i;
 
-	if (write) {
-		msc->write_count++;
-		msc->write_tput_old = msc->write_tput;
+	if (!src->ios)
+		return;
 
-		tput = throughput(start, end, size);
+	if (!dst->ios || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
 
-		if (tput > msc->write_max)
-			msc->write_max = tput;
-		if (tput < msc->write_min)
-			msc->write_min = tput;
+	dst->ios += src->ios;
+	dst->bytes += src->bytes;
 
-		msc->write_tput_instant = tput;
-		msc->write_tput = throughput_mean(tput, msc->write_tput,
-				msc->write_count);
-		msc->write_var = throughput_var(msc->write_var, tput,
-				msc->write_tput_old, msc->write_tput,
-				msc->write_count);
-	} else {
-		msc->read_count++;
-		msc->read_tput_old = msc->read_tput;
+	for (i = 0; i < MSC_HIST_BUCKETS; i++)
+		dst->hist[i] += src->hist[i];
+}
 
-		tput = throughput(start, end, size);
+static void collect_data(struct usb_msc_test *msc, struct timespec *start,
+		struct timespec *end, size_t size, unsigned int write)
+{
+	uint64_t		ns = timespec_ns(start, end);
 
-		if (tput > msc->read_max)
-			msc->read_max = tput;
-		if (tput < msc->read_min)
-			msc->read_min = tput;
+	if (write)
+		stats_add(&msc->write, ns, size);
+	else
+		stats_add(&msc->read, ns, size);
+}
 
-		msc->read_tput_instant = tput;
-		msc->read_tput = throughput_mean(tput, msc->read_tput,
-				msc->read_count);
-		msc->read_var = throughput_var(msc->read_var, tput,
-				msc->read_tput_old, msc->read_tput,
-				msc->read_count);
-	}
+/* throughput of one direction since the test started */
+static double test_throughput(struct usb_msc_test *msc, struct msc_stats *st)
+{
+	return throughput(st->bytes, timespec_ns(&msc->begin, &msc->end));
 }
 
+/* the progress line is redrawn at most this often */
+#define MSC_PROGRESS_NS		100000000ULL
+
 /**
  * report_progess - reports the progress of @test
  * @msc:	Mass Storage Test Context
  * @test:	test case number
  *
  * each test case implementation is required to call this function
- * in order for the user to get progress report.
+ * in order for the user to get progress report. Verbose output has one
+ * line per iteration, the overwrite-in-place line is only redrawn every
+ * MSC_PROGRESS_NS so that printing it doesn't cost a write() per I/O.
  */
 static void report_progress(struct usb_msc_test *msc,
 		enum usb_msc_test_case test)
@@ -257,6 +617,18 @@ static void report_progress(struct usb_msc_test *msc,
 	float		transferred = 0;
 	unsigned int	i;
 	char		unit = ' ';
+	uint64_t	now;
+
+	if (msc->quiet)
+		return;
+
+	if (!msc->verbose) {
+		now = now_ns();
+		if (msc->reported && now - msc->reported < MSC_PROGRESS_NS)
+			return;
+
+		msc->reported = now;
+	}
 
 	transferred = (float) msc->transferred;
 
@@ -271,1401 +643,6112 @@ static void report_progress(struct usb_msc_test *msc,
 
 	if (msc->verbose) {
 		printf("%d,%d,%4.02f,%4.02f\n",
-				test, msc->size, msc->read_tput_instant,
-				msc->write_tput_instant);
+				test, msc->size,
+				throughput(msc->read.last_bytes, msc->read.last),
+				throughput(msc->write.last_bytes, msc->write.last));
 	} else if (msc->variance) {
-		printf("\rT%2d: %4.02f %cB R %4.02f MB/s [s2 %2.02f] W %4.02f MB/s [s2 %2.02f] ... ",
-				test, transferred, unit, msc->read_tput,
-				msc->read_var, msc->write_tput,
-				msc->write_var);
+		printf("\rT%2d: %4.02f %cB R %4.02f MB/s [p99 %4.02f us] W %4.02f MB/s [p99 %4.02f us] ... ",
+				test, transferred, unit,
+				test_throughput(msc, &msc->read),
+				stats_percentile(&msc->read, 99) / 1000.0,
+				test_throughput(msc, &msc->write),
+				stats_percentile(&msc->write, 99) / 1000.0);
 	} else {
 		printf("\rT%2d: %4.02f %cB R %4.02f MB/s W %4.02f MB/s ... ",
-				test, transferred, unit, msc->read_tput,
-				msc->write_tput);
+				test, transferred, unit,
+				test_throughput(msc, &msc->read),
+				test_throughput(msc, &msc->write));
 	}
 
 	fflush(stdout);
 }
 
-static void print_summary(struct usb_msc_test *msc,
-		enum usb_msc_test_case test)
+static void print_stats(const char *name, struct msc_stats *st,
+		uint64_t elapsed)
 {
-	float		transferred = 0;
-	unsigned int	i;
-	char		unit = ' ';
-
-	transferred = (float) msc->transferred;
-
-	for (i = 0; i < ARRAY_SIZE(units); i++) {
-		if (transferred >= 1024.0) {
-			transferred /= 1024.0;
-			continue;
-		}
-		unit = units[i];
-		break;
-	}
-
-	printf("--------------------------------------------------\n");
-	printf("Summary: Test %d  %4.02f %cB\n", test, transferred, unit);
-
-	printf("         %-8s | %-8s | %-8s | %-8s\n",
-			"min", "max", "mean", "variance");
-	printf("--------------------------------------------------\n");
-	printf("%-8s %-8.02f | %-8.02f | %-8.02f | %-8.02f\n", "Write",
-			msc->write_min, msc->write_max, msc->write_tput,
-			msc->write_var);
-
-	printf("%-8s %-8.02f | %-8.02f | %-8.02f | %-8.02f\n", "Read",
-			msc->read_min, msc->read_max, msc->read_tput,
-			msc->read_var);
+	printf("%-7s%9.0f | %8.02f | %8.02f | %8.02f | %8.02f | %8.02f | %8.02f\n",
+			name, elapsed ? st->ios * 1000000000.0 / elapsed : 0,
+			throughput(st->bytes, elapsed),
+			stats_percentile(st, 50) / 1000.0,
+			stats_percentile(st, 90) / 1000.0,
+			stats_percentile(st, 99) / 1000.0,
+			stats_percentile(st, 99.9) / 1000.0,
+			st->max / 1000.0);
 }
 
-/* ------------------------------------------------------------------------- */
-
 /**
- * do_write - Write txbuf to fd
- * @msc:	Mass Storage Test Context
- * @bytes:	Amount of bytes to write
+ * print_histogram - print the latency distribution of one direction
+ * @name:	direction
+ * @st:		statistics of that direction
+ *
+ * Buckets are merged per power of two, row n holding the requests
+ * below MSC_HIST_SUB << n ns.
  */
-static int do_write(struct usb_msc_test *msc, unsigned bytes)
+static void print_histogram(const char *name, struct msc_stats *st)
 {
-	unsigned int		done = 0;
-	int			ret = -EINVAL;
-
-	unsigned char		*buf = msc->txbuf;
-
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-	while (done < bytes) {
-		unsigned	size = bytes - done;
+	uint64_t		count;
+	uint64_t		seen = 0;
+	unsigned int		i;
+	unsigned int		j;
 
-		if (size > msc->pempty)
-			size = msc->pempty;
+	if (!st->ios)
+		return;
 
-		ret = write(msc->fd, buf + done, size);
-		if (ret < 0)
-			goto err;
+	printf("%s latency, us\n", name);
 
-		done += ret;
-		msc->pempty -= ret;
+	for (i = 0; i < MSC_HIST_BUCKETS; i += MSC_HIST_SUB) {
+		count = 0;
+		for (j = i; j < i + MSC_HIST_SUB; j++)
+			count += st->hist[j];
 
-		if (msc->pempty == 0) {
-			off_t		pos;
+		if (!count)
+			continue;
 
-			msc->pempty = msc->psize;
-			done = 0;
-			pos = lseek(msc->fd, 0, SEEK_SET);
-			if (pos < 0) {
-				ret = (int) pos;
-				goto err;
-			}
+		seen += count;
+		printf("  < %10.02f | %10llu | %6.02f%% | %6.02f%% | ",
+				((uint64_t) MSC_HIST_SUB << (i /
+					MSC_HIST_SUB)) / 1000.0,
+				(unsigned long long) count,
+				count * 100.0 / st->ios, seen * 100.0 / st->ios);
 
-		}
+		for (j = 0; j < count * 40 / st->ios; j++)
+			putchar('#');
+		putchar('\n');
 	}
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-	collect_data(msc, &start, &end, ret, true);
-	msc->offset = ret;
+}
 
-	return 0;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} msc_cpu_events[MSC_CPU_COUNTERS] = {
+	[MSC_CPU_CLOCK]		= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[MSC_CPU_CYCLES]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[MSC_CPU_INSNS]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[MSC_CPU_CSW]		= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[MSC_CPU_FAULTS]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
 
-err:
-	return ret;
+static int cpu_event_open(unsigned counter, int user_only)
+{
+	struct perf_event_attr	attr;
+
+	memset(&attr, 0x00, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = msc_cpu_events[counter].type;
+	attr.config = msc_cpu_events[counter].config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = user_only;
+	attr.exclude_hv = user_only;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+			PERF_FLAG_FD_CLOEXEC);
 }
+#endif
 
 /**
- * do_read - Read from fd to rxbuf
- * @msc:	Mass Storage Test Context
- * @bytes:	Amount of data to read
+ * cpu_start - start accounting what the test about to run costs
+ * @cpu:	accounting state
+ *
+ * Counters follow this process and every thread it creates from now
+ * on. perf events come first. With perf_event_paranoid > 1 only user
+ * space can be counted, and where perf isn't allowed at all the task
+ * clock, context switches and page faults come from getrusage() and
+ * cycles are unknown.
  */
-static int do_read(struct usb_msc_test *msc, unsigned bytes)
+static void cpu_start(struct msc_cpu *cpu)
 {
-	unsigned int		done = 0;
-	int			ret;
-
-	unsigned char		*buf = msc->rxbuf;
+	unsigned int		i;
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-	while (done < bytes) {
-		ret = read(msc->fd, buf + done, bytes - done);
-		if (ret < 0) {
-			perror("do_read");
-			goto err;
-		}
+	memset(cpu, 0x00, sizeof(*cpu));
 
-		if (ret == 0)
-			goto err;
+	for (i = 0; i < MSC_CPU_COUNTERS; i++) {
+		cpu->fd[i] = -1;
 
-		done += ret;
-		msc->transferred += ret;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+		cpu->fd[i] = cpu_event_open(i, false);
+		if (cpu->fd[i] < 0)
+			cpu->fd[i] = cpu_event_open(i, true);
+		if (cpu->fd[i] >= 0) {
+			ioctl(cpu->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(cpu->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
 	}
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-	collect_data(msc, &start, &end, ret, false);
-
-	return 0;
-
-err:
-	return ret;
-}
-
-static void __maybe_unused hexdump(char *buf, unsigned size)
-{
-	unsigned int		i;
 
-	for (i = 0; i < size; i++) {
-		if (i && ((i % 16) == 0))
-			printf("\n");
-		printf("%02x ", buf[i]);
-	}
-	printf("\n");
+	getrusage(RUSAGE_SELF, &cpu->ru);
 }
 
-/**
- * do_verify - Verify consistency of data
- * @msc:	Mass Storage Test Context
- * @bytes:	Amount of data to verify
- */
-static int do_verify(struct usb_msc_test *msc, unsigned bytes)
+static uint64_t timeval_ns(struct timeval *start, struct timeval *end)
 {
-	unsigned char		tx_hash[SHA_DIGEST_LENGTH];
-	unsigned char		rx_hash[SHA_DIGEST_LENGTH];
-	unsigned char		*ret;
-
-	ret = SHA1(msc->txbuf, bytes, tx_hash);
-	if (!ret)
-		return -EINVAL;
-
-	ret = SHA1(msc->rxbuf, bytes, rx_hash);
-	if (!ret)
-		return -EINVAL;
-
-	return strncmp((char *) tx_hash, (char *) rx_hash, SHA_DIGEST_LENGTH);
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		(end->tv_usec - start->tv_usec) * 1000ULL;
 }
 
-/**
- * do_writev - SG Write txbuf to fd
- * @msc:	Mass Storage Test Context
- * @iov:	iovec structure pointer
- * @count:	how many transfers
- */
-static int do_writev(struct usb_msc_test *msc, const struct iovec *iov,
-		unsigned count)
+/* stop counting, @cpu->val holds what could be measured */
+static void cpu_stop(struct msc_cpu *cpu)
 {
-	off_t			pos;
-	int			ret;
-
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-	ret = writev(msc->fd, iov, count);
-	if (ret < 0)
-		goto err;
+	struct rusage		ru;
+	struct rusage		*old = &cpu->ru;
+	uint64_t		val;
+	unsigned int		i;
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-	collect_data(msc, &start, &end, ret, true);
+	getrusage(RUSAGE_SELF, &ru);
 
-	msc->pempty -= ret;
+	for (i = 0; i < MSC_CPU_COUNTERS; i++) {
+		if (cpu->fd[i] < 0)
+			continue;
 
-	if (msc->pempty == 0) {
-		msc->pempty = msc->psize;
-		pos = lseek(msc->fd, 0, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+		ioctl(cpu->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+		if (read(cpu->fd[i], &val, sizeof(val)) == sizeof(val)) {
+			cpu->val[i] = val;
+			cpu->valid |= 1 << i;
 		}
 
+		close(cpu->fd[i]);
+		cpu->fd[i] = -1;
 	}
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+	if (!(cpu->valid & (1 << MSC_CPU_CLOCK))) {
+		cpu->val[MSC_CPU_CLOCK] =
+			timeval_ns(&old->ru_utime, &ru.ru_utime) +
+			timeval_ns(&old->ru_stime, &ru.ru_stime);
+		cpu->valid |= 1 << MSC_CPU_CLOCK;
 	}
 
-	msc->offset = ret;
-
-	return 0;
+	if (!(cpu->valid & (1 << MSC_CPU_CSW))) {
+		cpu->val[MSC_CPU_CSW] = ru.ru_nvcsw - old->ru_nvcsw +
+			ru.ru_nivcsw - old->ru_nivcsw;
+		cpu->valid |= 1 << MSC_CPU_CSW;
+	}
 
-err:
-	return ret;
+	if (!(cpu->valid & (1 << MSC_CPU_FAULTS))) {
+		cpu->val[MSC_CPU_FAULTS] = ru.ru_minflt - old->ru_minflt +
+			ru.ru_majflt - old->ru_majflt;
+		cpu->valid |= 1 << MSC_CPU_FAULTS;
+	}
 }
 
 /**
- * do_read - SG Read from fd to rxbuf
- * @msc:	Mass Storage Test Context
- * @iov:	iovec structure pointer
- * @count:	how many transfers
+ * print_cpu - what moving @bytes cost the host
+ * @cpu:	accounting of the test
+ * @bytes:	bytes written and read by the test
+ *
+ * CPU seconds per GB and cycles per byte are what tell a host bound run
+ * from a device bound one, and an engine that got cheaper from one that
+ * didn't.
  */
-static int do_readv(struct usb_msc_test *msc, const struct iovec *iov,
-		unsigned bytes)
+static void print_cpu(struct msc_cpu *cpu, uint64_t bytes)
 {
-	int			ret;
+	double			secs = cpu->val[MSC_CPU_CLOCK] / 1000000000.0;
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-	ret = readv(msc->fd, iov, bytes);
-	if (ret < 0)
-		goto err;
+	printf("CPU    %9.03f s | %8.03f s/GB", secs,
+			bytes ? secs * 1000000000.0 / bytes : 0);
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-	collect_data(msc, &start, &end, ret, false);
-	msc->transferred += ret;
+	if ((cpu->valid & (1 << MSC_CPU_CYCLES)) && bytes)
+		printf(" | %6.02f cycles/B",
+				(double) cpu->val[MSC_CPU_CYCLES] / bytes);
+	else
+		printf(" | %6s cycles/B", "-");
 
-	return 0;
+	if ((cpu->valid & (1 << MSC_CPU_INSNS)) &&
+			(cpu->valid & (1 << MSC_CPU_CYCLES)) &&
+			cpu->val[MSC_CPU_CYCLES])
+		printf(" | IPC %4.02f", (double) cpu->val[MSC_CPU_INSNS] /
+				cpu->val[MSC_CPU_CYCLES]);
+	else
+		printf(" | IPC %4s", "-");
 
-err:
-	return ret;
+	printf(" | %llu csw | %llu faults\n",
+			(unsigned long long) cpu->val[MSC_CPU_CSW],
+			(unsigned long long) cpu->val[MSC_CPU_FAULTS]);
 }
 
-/* ------------------------------------------------------------------------- */
-
-/*
- * do_test_patterns - write known pattern and read it back
- * @msc:	Mass Storage Test Context
- */
-static int do_test_patterns(struct usb_msc_test *msc)
+static void print_summary(struct usb_msc_test *msc,
+		enum usb_msc_test_case test)
 {
-	int			ret = 0;
-	int			i;
-
-	for (i = 0; i < msc->count; i++) {
-		uint8_t		pattern = msc_patterns[msc->pattern];
-		off_t		pos;
-
-		memset(msc->txbuf, pattern, msc->size);
-		memset(msc->rxbuf, 0x00, msc->size);
+	float		transferred = 0;
+	unsigned int	i;
+	char		unit = ' ';
 
-		ret = do_write(msc, msc->size);
-		if (ret < 0)
-			break;
+	transferred = (float) msc->transferred;
 
-		pos = lseek(msc->fd, msc->offset - msc->size, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			break;
+	for (i = 0; i < ARRAY_SIZE(units); i++) {
+		if (transferred >= 1024.0) {
+			transferred /= 1024.0;
+			continue;
 		}
-
-		msc->offset = ret;
-
-		ret = do_read(msc, msc->size);
-		if (ret < 0)
-			break;
-
-		ret = do_verify(msc, msc->size);
-		if (ret < 0)
-			break;
-
-		report_progress(msc, MSC_TEST_PATTERNS);
+		unit = units[i];
+		break;
 	}
 
-	return ret;
+	printf("--------------------------------------------------------------------------------\n");
+	printf("Summary: Test %d  %4.02f %cB in %.03f s, latencies in us\n",
+			test, transferred, unit, msc->elapsed / 1000000000.0);
+
+	printf("       %9s | %8s | %8s | %8s | %8s | %8s | %8s\n",
+			"IOPS", "MB/s", "p50", "p90", "p99", "p99.9", "max");
+	printf("--------------------------------------------------------------------------------\n");
+	print_stats("Write", &msc->write, msc->elapsed);
+	print_stats("Read", &msc->read, msc->elapsed);
+	if (msc->discard.ios)
+		print_stats("Discard", &msc->discard, msc->elapsed);
+	if (msc->cpu.valid)
+		print_cpu(&msc->cpu, msc->read.bytes + msc->write.bytes);
+	if (msc->eagain)
+		printf("NOWAIT: %llu requests retried after EAGAIN\n",
+				(unsigned long long) msc->eagain);
 }
 
+/* ------------------------------------------------------------------------- */
+
+/*
+ * --log keeps a time series of the run in a ring of fixed size records,
+ * one per interval, in a file mapped by the logger thread. The I/O
+ * threads never see it: the logger samples their statistics and the
+ * record deltas are computed on its side.
+ */
+#define MSC_LOG_MAGIC		"MSCLOG\0\0"
+#define MSC_LOG_VERSION		1
+#define MSC_LOG_BUCKETS		(MSC_HIST_BUCKETS / MSC_HIST_SUB)
+
 /**
- * do_test_sg_random_both - write and read several of random size
- * @msc:	Mass Storage Test Context
+ * struct msc_log_dir - one direction of one interval
+ * @bytes:	bytes moved
+ * @ios:	requests completed
+ * @p50:	median latency, in ns
+ * @p99:	99th percentile latency, in ns
+ * @hist:	latencies per power of two, bucket n holds those below
+ *		MSC_HIST_SUB << n ns
  */
-static int do_test_sg_random_both(struct usb_msc_test *msc)
-{
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
+struct msc_log_dir {
+	uint64_t	bytes;
+	uint64_t	ios;
+	uint64_t	p50;
+	uint64_t	p99;
+	uint32_t	hist[MSC_LOG_BUCKETS];
+};
 
-	unsigned		sect_size = msc->sect_size;
-	unsigned		len = msc->size;
+/**
+ * struct msc_log_record - one interval
+ * @time:	end of the interval, in ns since the log started
+ * @read:	read side
+ * @write:	write side
+ */
+struct msc_log_record {
+	uint64_t		time;
+	struct msc_log_dir	read;
+	struct msc_log_dir	write;
+};
 
-	off_t			pos;
+/**
+ * struct msc_log_header - start of a log file, records follow it
+ * @magic:	MSC_LOG_MAGIC
+ * @version:	MSC_LOG_VERSION
+ * @record_size: sizeof(struct msc_log_record)
+ * @entries:	records in the ring
+ * @buckets:	MSC_LOG_BUCKETS
+ * @interval:	length of one interval, in ns
+ * @head:	records written so far, record n lives at n % @entries
+ */
+struct msc_log_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;
+	uint32_t	entries;
+	uint32_t	buckets;
+	uint64_t	interval;
+	uint64_t	head;
+};
 
-	int			ret = 0;
-	int			i;
+/**
+ * struct msc_logger - --log state
+ * @thread:	logger thread
+ * @lock:	protects everything below
+ * @cond:	wakes the logger early when it should stop
+ * @stop:	set when the run is over
+ * @src:	test contexts being sampled
+ * @nr_src:	number of entries in @src
+ * @cur:	read and write totals of @src, scratch space for sampling
+ * @prev:	read and write totals of @src at the last sample
+ * @acc:	read and write deltas of the current interval
+ * @fd:		log file
+ * @size:	log file size
+ * @hdr:	log file mapping
+ * @records:	the ring, right after @hdr
+ * @entries:	records in the ring
+ * @interval:	length of one interval, in ns
+ * @start:	CLOCK_MONOTONIC when the log started, in ns
+ */
+struct msc_logger {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			stop;
+
+	struct usb_msc_test	**src;
+	unsigned		nr_src;
+	struct msc_stats	cur[2];
+	struct msc_stats	prev[2];
+	struct msc_stats	acc[2];
+
+	int			fd;
+	size_t			size;
+	struct msc_log_header	*hdr;
+	struct msc_log_record	*records;
+	unsigned		entries;
+	uint64_t		interval;
+	uint64_t		start;
+};
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= 8 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 8 * sect_size,
-			.iov_len	= 1 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 9 * sect_size,
-			.iov_len	= 3 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 12 * sect_size,
-			.iov_len	= 32 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 44 * sect_size,
-			.iov_len	= 20 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 64 * sect_size,
-			.iov_len	= 14 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 78 * sect_size,
-			.iov_len	= 16 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 94 * sect_size,
-			.iov_len	= 34 * sect_size,
-		},
-	};
+static uint64_t monotonic_ns(void)
+{
+	struct timespec		now;
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= 8 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 8 * sect_size,
-			.iov_len	= 1 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 9 * sect_size,
-			.iov_len	= 3 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 12 * sect_size,
-			.iov_len	= 32 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 44 * sect_size,
-			.iov_len	= 20 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 64 * sect_size,
-			.iov_len	= 14 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 78 * sect_size,
-			.iov_len	= 16 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 94 * sect_size,
-			.iov_len	= 34 * sect_size,
-		},
-	};
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-	msc->offset = ret;
+/* add what I/O threads counted in @src to @st */
+static void logger_read(struct msc_stats *st, struct msc_stats *src)
+{
+	uint64_t		max;
+	unsigned int		i;
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	st->ios += __atomic_load_n(&src->ios, __ATOMIC_RELAXED);
+	st->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
 
-		ret = do_writev(msc, tiov, 8);
-		if (ret < 0)
-			goto err;
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > st->max)
+		st->max = max;
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	for (i = 0; i < MSC_HIST_BUCKETS; i++)
+		st->hist[i] += __atomic_load_n(&src->hist[i], __ATOMIC_RELAXED);
+}
 
-		ret = do_readv(msc, riov, 8);
-		if (ret < 0)
-			goto err;
+/* read and write totals of every source, into @st[0] and @st[1] */
+static void logger_snapshot(struct msc_logger *log, struct msc_stats *st)
+{
+	unsigned int		i;
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+	memset(st, 0x00, 2 * sizeof(*st));
 
-		report_progress(msc, MSC_TEST_SG_RANDOM_BOTH);
+	for (i = 0; i < log->nr_src; i++) {
+		logger_read(&st[0], &log->src[i]->read);
+		logger_read(&st[1], &log->src[i]->write);
 	}
-
-err:
-	return ret;
 }
 
 /**
- * do_test_sg_random_write - write several of random size, read 1 64k
- * @msc:	Mass Storage Test Context
+ * logger_sample - fold what happened since the last sample in @log->acc
+ * @log:	the logger
+ *
+ * Totals going backwards mean a suite or sweep reset them for the next
+ * run, everything counted since then is new.
  */
-static int do_test_sg_random_write(struct usb_msc_test *msc)
+static void logger_sample(struct msc_logger *log)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
-
-	unsigned		sect_size = msc->sect_size;
-	unsigned		len = msc->size;
+	struct msc_stats	*cur = log->cur;
+	unsigned int		d;
+	unsigned int		i;
 
-	off_t			pos;
+	logger_snapshot(log, cur);
 
-	int			ret = 0;
-	int			i;
+	for (d = 0; d < 2; d++) {
+		struct msc_stats *prev = &log->prev[d];
+		struct msc_stats *acc = &log->acc[d];
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= 8 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 8 * sect_size,
-			.iov_len	= 1 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 9 * sect_size,
-			.iov_len	= 3 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 12 * sect_size,
-			.iov_len	= 32 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 44 * sect_size,
-			.iov_len	= 20 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 64 * sect_size,
-			.iov_len	= 14 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 78 * sect_size,
-			.iov_len	= 16 * sect_size,
-		},
-		{
-			.iov_base	= txbuf + 94 * sect_size,
-			.iov_len	= 34 * sect_size,
-		},
-	};
+		if (cur[d].ios < prev->ios)
+			memset(prev, 0x00, sizeof(*prev));
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+		acc->ios += cur[d].ios - prev->ios;
+		acc->bytes += cur[d].bytes - prev->bytes;
+		if (cur[d].max > acc->max)
+			acc->max = cur[d].max;
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+		for (i = 0; i < MSC_HIST_BUCKETS; i++)
+			if (cur[d].hist[i] > prev->hist[i])
+				acc->hist[i] += cur[d].hist[i] - prev->hist[i];
 	}
 
-	msc->offset = ret;
+	memcpy(log->prev, cur, sizeof(log->prev));
+}
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+static void logger_fill(struct msc_log_dir *dir, struct msc_stats *st)
+{
+	unsigned int		i;
 
-		ret = do_writev(msc, tiov, 8);
-		if (ret < 0)
-			goto err;
+	memset(dir, 0x00, sizeof(*dir));
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	dir->bytes = st->bytes;
+	dir->ios = st->ios;
+	dir->p50 = stats_percentile(st, 50);
+	dir->p99 = stats_percentile(st, 99);
 
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
+	for (i = 0; i < MSC_HIST_BUCKETS; i++)
+		dir->hist[i / MSC_HIST_SUB] += st->hist[i];
+}
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+/* close the current interval and append it to the ring */
+static void logger_emit(struct msc_logger *log)
+{
+	uint64_t		head = log->hdr->head;
+	struct msc_log_record	*rec = &log->records[head % log->entries];
 
-		report_progress(msc, MSC_TEST_SG_RANDOM_WRITE);
-	}
+	logger_sample(log);
 
-err:
-	return ret;
+	rec->time = monotonic_ns() - log->start;
+	logger_fill(&rec->read, &log->acc[0]);
+	logger_fill(&rec->write, &log->acc[1]);
+	memset(log->acc, 0x00, sizeof(log->acc));
+
+	/* a reader seeing the new head also sees the record */
+	__atomic_store_n(&log->hdr->head, head + 1, __ATOMIC_RELEASE);
 }
 
-/**
- * do_test_sg_random_read - write 1 64k sg and read in several of random size
- * @msc:	Mass Storage Test Context
- */
-static int do_test_sg_random_read(struct usb_msc_test *msc)
+static void *logger_thread(void *data)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
+	struct msc_logger	*log = data;
+	uint64_t		next = log->start;
+	struct timespec		ts;
 
-	unsigned		sect_size = msc->sect_size;
-	unsigned		len = msc->size;
+	pthread_mutex_lock(&log->lock);
 
-	off_t			pos;
+	while (!log->stop) {
+		next += log->interval;
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
 
-	int			ret = 0;
-	int			i;
+		while (!log->stop && pthread_cond_timedwait(&log->cond,
+					&log->lock, &ts) != ETIMEDOUT)
+			;
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+		/* on stop, this is the last and possibly shorter interval */
+		logger_emit(log);
+	}
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= 8 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 8 * sect_size,
-			.iov_len	= 1 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 9 * sect_size,
-			.iov_len	= 3 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 12 * sect_size,
-			.iov_len	= 32 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 44 * sect_size,
-			.iov_len	= 20 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 64 * sect_size,
-			.iov_len	= 14 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 78 * sect_size,
-			.iov_len	= 16 * sect_size,
-		},
-		{
-			.iov_base	= rxbuf + 94 * sect_size,
-			.iov_len	= 34 * sect_size,
-		},
-	};
+	pthread_mutex_unlock(&log->lock);
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+	return NULL;
+}
 
-	msc->offset = ret;
+/**
+ * logger_attach - sample @src from now on
+ * @log:	the logger, NULL without --log
+ * @src:	test contexts, their statistics are added up
+ * @nr_src:	number of entries in @src, 0 to stop sampling
+ *
+ * What the previous sources did since the last sample still counts
+ * towards the current interval, and the new ones are sampled relative
+ * to where they are now.
+ */
+static void logger_attach(struct msc_logger *log, struct usb_msc_test **src,
+		unsigned nr_src)
+{
+	if (!log)
+		return;
+
+	pthread_mutex_lock(&log->lock);
+	logger_sample(log);
+	log->src = src;
+	log->nr_src = nr_src;
+	logger_snapshot(log, log->prev);
+	pthread_mutex_unlock(&log->lock);
+}
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+/**
+ * logger_start - create the --log file and start the logger thread
+ * @log:	the logger, @entries and @interval already set
+ * @path:	log file, truncated if it exists
+ */
+static int logger_start(struct msc_logger *log, const char *path)
+{
+	pthread_condattr_t	attr;
+	void			*map;
+	int			ret;
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
+	log->size = sizeof(*log->hdr) +
+		(size_t) log->entries * sizeof(*log->records);
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0)
-			goto err;
+	log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0) {
+		ret = -errno;
+		goto err0;
+	}
 
-		ret = do_readv(msc, riov, 8);
-		if (ret < 0)
-			goto err;
+	ret = ftruncate(log->fd, log->size);
+	if (ret < 0) {
+		ret = -errno;
+		goto err1;
+	}
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+	map = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			log->fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto err1;
+	}
 
-		report_progress(msc, MSC_TEST_SG_RANDOM_READ);
+	log->hdr = map;
+	log->records = (struct msc_log_record *) (log->hdr + 1);
+
+	memcpy(log->hdr->magic, MSC_LOG_MAGIC, sizeof(log->hdr->magic));
+	log->hdr->version = MSC_LOG_VERSION;
+	log->hdr->record_size = sizeof(*log->records);
+	log->hdr->entries = log->entries;
+	log->hdr->buckets = MSC_LOG_BUCKETS;
+	log->hdr->interval = log->interval;
+	log->hdr->head = 0;
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	log->stop = false;
+	log->start = monotonic_ns();
+
+	ret = pthread_create(&log->thread, NULL, logger_thread, log);
+	if (ret) {
+		ret = -ret;
+		goto err2;
 	}
 
-err:
+	return 0;
+
+err2:
+	pthread_cond_destroy(&log->cond);
+	pthread_mutex_destroy(&log->lock);
+	munmap(log->hdr, log->size);
+
+err1:
+	close(log->fd);
+
+err0:
 	return ret;
 }
 
-/**
- * do_test_write_past_last - attempt to write past last sector
- * @msc:	Mass Storage Test Context
- */
-static int do_test_write_past_last(struct usb_msc_test *msc)
+/* write out the last interval and close the log */
+static void logger_stop(struct msc_logger *log)
 {
-	off_t			pos;
+	if (!log)
+		return;
 
-	int			ret = 0;
-	int			i;
+	pthread_mutex_lock(&log->lock);
+	log->stop = true;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->lock);
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	pthread_join(log->thread, NULL);
+	pthread_cond_destroy(&log->cond);
+	pthread_mutex_destroy(&log->lock);
 
-		/* seek to one sector less then needed */
-		pos = lseek(msc->fd, msc->psize - msc->size + msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	munmap(log->hdr, log->size);
+	close(log->fd);
+}
 
-		ret = do_write(msc, msc->size);
-		if (ret >=  0) {
-			ret = -EINVAL;
-			goto err;
-		} else {
-			ret = 0;
-		}
+/* rough percentile out of a struct msc_log_dir, upper end of its bucket */
+static uint64_t log_percentile(struct msc_log_dir *dir, double pct)
+{
+	uint64_t		target = dir->ios * pct / 100.0 + 0.5;
+	uint64_t		seen = 0;
+	unsigned int		i;
 
-		report_progress(msc, MSC_TEST_WRITE_PAST_LAST);
+	if (!dir->ios)
+		return 0;
+
+	for (i = 0; i < MSC_LOG_BUCKETS - 1; i++) {
+		seen += dir->hist[i];
+		if (seen >= target)
+			break;
 	}
 
-err:
-	return ret;
+	return (uint64_t) MSC_HIST_SUB << i;
+}
+
+static void print_log_dir(struct msc_log_dir *dir, uint64_t ns)
+{
+	printf(" %8.02f %7.0f %8.02f %8.02f %8.02f",
+			throughput(dir->bytes, ns),
+			dir->ios * 1000000000.0 / ns,
+			dir->p50 / 1000.0, dir->p99 / 1000.0,
+			log_percentile(dir, 99.9) / 1000.0);
 }
 
 /**
- * do_test_lseek_past_last - attempt to read starting past the last sector
- * @msc:	Mass Storage Test Context
+ * dump_log - print the records of a --log file, oldest first
+ * @path:	log file
+ *
+ * Works on a log still being written to, records overwritten while they
+ * are printed may come out mixed up. p99.9 only comes from the power of
+ * two buckets, so it's an upper bound within a factor of two.
  */
-static int do_test_lseek_past_last(struct usb_msc_test *msc)
+static int dump_log(const char *path)
 {
-	off_t			pos;
+	struct msc_log_header	*hdr;
+	struct msc_log_record	*records;
+	struct stat		st;
+	uint64_t		head;
+	uint64_t		first;
+	uint64_t		last = 0;
+	uint64_t		n;
+	void			*map;
+	int			ret;
+	int			fd;
 
-	int			ret = 0;
-	int			i;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto err0;
+	}
 
-	for (i = 0; i < msc->count; i++) {
-		pos = lseek(msc->fd, msc->psize + msc->sect_size,
-				SEEK_SET);
-		if (pos >= 0) {
-			ret = -EINVAL;
-			goto err;
-		}
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		goto err1;
+	}
 
-		report_progress(msc, MSC_TEST_LSEEK_PAST_LAST);
+	if ((size_t) st.st_size < sizeof(*hdr)) {
+		ret = -EINVAL;
+		goto err1;
 	}
 
-err:
-	return ret;
-}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto err1;
+	}
 
-/**
- * do_test_read_past_last - attempt to read past last sector
- * @msc:	Mass Storage Test Context
- */
-static int do_test_read_past_last(struct usb_msc_test *msc)
-{
-	off_t			pos;
+	hdr = map;
+	records = (struct msc_log_record *) (hdr + 1);
 
-	int			ret = 0;
-	int			i;
+	if (memcmp(hdr->magic, MSC_LOG_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != MSC_LOG_VERSION ||
+			hdr->record_size != sizeof(*records) ||
+			hdr->buckets != MSC_LOG_BUCKETS || !hdr->entries ||
+			sizeof(*hdr) + (uint64_t) hdr->entries *
+			sizeof(*records) > (uint64_t) st.st_size) {
+		ret = -EINVAL;
+		goto err2;
+	}
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	first = head > hdr->entries ? head - hdr->entries : 0;
 
-		/* seek to one sector less then needed */
-		pos = lseek(msc->fd, msc->psize - msc->size + msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	printf("%9s | %-44s | %-44s\n", "", "Write", "Read");
+	printf("%9s | %8s %7s %8s %8s %8s | %8s %7s %8s %8s %8s\n",
+			"time s", "MB/s", "IOPS", "p50", "p99", "p99.9",
+			"MB/s", "IOPS", "p50", "p99", "p99.9");
 
-		ret = do_read(msc, msc->size);
-		if (ret > 0) {
-			ret = -EINVAL;
-			goto err;
-		}
+	for (n = first; n < head; n++) {
+		struct msc_log_record *rec = &records[n % hdr->entries];
+		uint64_t	ns;
 
-		report_progress(msc, MSC_TEST_READ_PAST_LAST);
+		/* the first interval after a wrap starts in the dark */
+		if (n == first && first)
+			ns = hdr->interval;
+		else
+			ns = rec->time - last;
+		last = rec->time;
+
+		if (!ns)
+			continue;
+
+		printf("%9.03f |", rec->time / 1000000000.0);
+		print_log_dir(&rec->write, ns);
+		printf(" |");
+		print_log_dir(&rec->read, ns);
+		printf("\n");
 	}
 
-err:
+	ret = 0;
+
+err2:
+	munmap(map, st.st_size);
+
+err1:
+	close(fd);
+
+err0:
 	return ret;
 }
 
-/**
- * do_test_sg_128sect - SG write/read/verify 8 sectors at a time
- * @msc:	Mass Storage Test Context
- */
-static int do_test_sg_128sect(struct usb_msc_test *msc)
-{
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
+/* ------------------------------------------------------------------------- */
 
-	unsigned		len = 128 * msc->sect_size;
+#define MSC_STAMP_MAGIC		0x4d53		/* "MS" */
 
-	off_t			pos;
+/* msc_stamp.fill for generated payloads, patterns are 0x00 - 0xff */
+#define MSC_FILL_PRNG		0x100
 
-	int			ret = 0;
-	int			i;
+/* bad sectors reported per request before we just count them */
+#define MSC_STAMP_REPORT	8
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+/**
+ * struct msc_stamp - header at the start of every sector we write
+ * @lba:	sector this data was written to
+ * @generation:	write generation, grows with every write request
+ * @seed:	run seed
+ * @magic:	MSC_STAMP_MAGIC
+ * @fill:	MSC_FILL_PRNG or the pattern byte filling the payload
+ * @crc:	CRC32C of the header, except this field
+ *
+ * With it every sector read back can be checked on its own, without a
+ * copy of what was written, and a failure names the offending LBA.
+ */
+struct msc_stamp {
+	uint64_t	lba;
+	uint64_t	generation;
+	uint64_t	seed;
+	uint16_t	magic;
+	uint16_t	fill;
+	uint32_t	crc;
+};
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+static uint32_t crc32c_table[8][256];
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+/* slicing-by-8 CRC32C, for CPUs without a CRC instruction */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while (len && ((unsigned long) buf & 7)) {
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
 	}
 
-	msc->offset = ret;
+	while (len >= 8) {
+		uint64_t	v = *(const uint64_t *) buf ^ crc;
+
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		buf += 8;
+		len -= 8;
+	}
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
-
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
-
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
-
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
-
-		report_progress(msc, MSC_TEST_SG_128SECT);
-	}
-
-err:
-	return ret;
+	return crc;
 }
 
-/**
- * do_test_sg_64sect - SG write/read/verify 8 sectors at a time
- * @msc:	Mass Storage Test Context
- */
-static int do_test_sg_64sect(struct usb_msc_test *msc)
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf,
+		size_t len)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
-
-	unsigned		len = 64 * msc->sect_size;
-
-	off_t			pos;
-
-	int			ret = 0;
-	int			i;
-
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+	uint64_t		crc64;
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+	while (len && ((unsigned long) buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+	crc64 = crc;
+	while (len >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *) buf);
+		buf += 8;
+		len -= 8;
 	}
+	crc = crc64;
 
-	msc->offset = ret;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	return crc;
+}
+#endif
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
+static uint32_t (*crc32c)(uint32_t crc, const unsigned char *buf,
+		size_t len) = crc32c_sw;
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+static void crc32c_init(void)
+{
+	unsigned int		i;
+	unsigned int		j;
 
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
+	for (i = 0; i < 256; i++) {
+		uint32_t	crc = i;
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
 
-		report_progress(msc, MSC_TEST_SG_64SECT);
+		crc32c_table[0][i] = crc;
 	}
 
-err:
-	return ret;
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_sse42;
+#endif
 }
 
-/**
- * do_test_sg_32sect - SG write/read/verify 8 sectors at a time
- * @msc:	Mass Storage Test Context
+static uint32_t stamp_crc(struct msc_stamp *stamp)
+{
+	return ~crc32c(~0U, (const unsigned char *) stamp,
+			offsetof(struct msc_stamp, crc));
+}
+
+/*
+ * Sector payloads come from a counter based generator keyed by (seed,
+ * LBA, generation): word i of a sector is lowbias32(k1 + i) ^ k2. Any
+ * word can be recomputed on its own, so the reader checks data against
+ * the generator instead of against a stored copy of what was written.
+ * The data doesn't compress or dedup either.
  */
-static int do_test_sg_32sect(struct usb_msc_test *msc)
+static uint64_t mix64(uint64_t z)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
 
-	unsigned		len = 32 * msc->sect_size;
+	return z ^ (z >> 31);
+}
 
-	off_t			pos;
+static uint32_t lowbias32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
 
-	int			ret = 0;
-	int			i;
+	return x;
+}
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+static void prng_fill_scalar(uint32_t *w, unsigned n, uint32_t k1,
+		uint32_t k2)
+{
+	unsigned int		i;
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+	for (i = 0; i < n; i++)
+		w[i] = lowbias32(k1 + i) ^ k2;
+}
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+/* index of the first word that doesn't match the generator, or @n */
+static unsigned prng_check_scalar(const uint32_t *w, unsigned n, uint32_t k1,
+		uint32_t k2)
+{
+	unsigned int		i;
 
-	msc->offset = ret;
+	for (i = 0; i < n; i++)
+		if (w[i] != (lowbias32(k1 + i) ^ k2))
+			break;
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	return i;
+}
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static __m256i lowbias32_avx2(__m256i x)
+{
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	return x;
+}
 
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
+__attribute__((target("avx2")))
+static void prng_fill_avx2(uint32_t *w, unsigned n, uint32_t k1, uint32_t k2)
+{
+	__m256i			ctr;
+	__m256i			key = _mm256_set1_epi32(k2);
+	__m256i			eight = _mm256_set1_epi32(8);
+	unsigned int		i;
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+	ctr = _mm256_add_epi32(_mm256_set1_epi32(k1),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
 
-		report_progress(msc, MSC_TEST_SG_32SECT);
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i		x = _mm256_xor_si256(lowbias32_avx2(ctr), key);
+
+		_mm256_storeu_si256((__m256i *) (w + i), x);
+		ctr = _mm256_add_epi32(ctr, eight);
 	}
 
-err:
-	return ret;
+	prng_fill_scalar(w + i, n - i, k1 + i, k2);
 }
 
-/**
- * do_test_sg_8sect - SG write/read/verify 8 sectors at a time
- * @msc:	Mass Storage Test Context
- */
-static int do_test_sg_8sect(struct usb_msc_test *msc)
+__attribute__((target("avx2")))
+static unsigned prng_check_avx2(const uint32_t *w, unsigned n, uint32_t k1,
+		uint32_t k2)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
+	__m256i			ctr;
+	__m256i			key = _mm256_set1_epi32(k2);
+	__m256i			eight = _mm256_set1_epi32(8);
+	unsigned int		i;
 
-	unsigned		len = 8 * msc->sect_size;
+	ctr = _mm256_add_epi32(_mm256_set1_epi32(k1),
+			_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
 
-	off_t			pos;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i		x = _mm256_xor_si256(lowbias32_avx2(ctr), key);
+		__m256i		y;
 
-	int			ret = 0;
-	int			i;
+		y = _mm256_loadu_si256((const __m256i *) (w + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)) != -1)
+			break;
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+		ctr = _mm256_add_epi32(ctr, eight);
+	}
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+	return i + prng_check_scalar(w + i, n - i, k1 + i, k2);
+}
+#endif
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+static void (*prng_fill)(uint32_t *w, unsigned n, uint32_t k1,
+		uint32_t k2) = prng_fill_scalar;
+static unsigned (*prng_check)(const uint32_t *w, unsigned n, uint32_t k1,
+		uint32_t k2) = prng_check_scalar;
+
+static void prng_init(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2")) {
+		prng_fill = prng_fill_avx2;
+		prng_check = prng_check_avx2;
 	}
+#endif
+}
 
-	msc->offset = ret;
+static void prng_key(struct msc_stamp *stamp, uint32_t *k1, uint32_t *k2)
+{
+	uint64_t		k;
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	k = mix64(stamp->seed ^ mix64(stamp->lba ^
+				mix64(stamp->generation)));
+	*k1 = k;
+	*k2 = k >> 32;
+}
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
+/**
+ * fill_buffer - fill every sector of @buf with stamped test data
+ * @msc:	Mass Storage Test Context
+ * @buf:	data about to be written
+ * @bytes:	length of @buf, a multiple of the sector size
+ * @offset:	device offset @buf is going to be written to
+ * @generation:	generation of this write
+ *
+ * The payload comes from the generator, or is msc->fill repeated when
+ * a fixed pattern was asked for.
+ */
+static void fill_buffer(struct usb_msc_test *msc, unsigned char *buf,
+		unsigned bytes, uint64_t offset, uint64_t generation)
+{
+	unsigned		sect_size = msc->sect_size;
+	unsigned		words = (sect_size - sizeof(struct msc_stamp)) / 4;
+	uint64_t		lba = offset / sect_size;
+	unsigned int		i;
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
+	for (i = 0; i < bytes / sect_size; i++) {
+		struct msc_stamp *stamp = (void *) (buf + i * sect_size);
+		uint32_t	k1;
+		uint32_t	k2;
+
+		stamp->lba = lba + i;
+		stamp->generation = generation;
+		stamp->seed = msc->seed;
+		stamp->magic = MSC_STAMP_MAGIC;
+		stamp->fill = msc->fill;
+		stamp->crc = stamp_crc(stamp);
+
+		if (msc->fill == MSC_FILL_PRNG) {
+			prng_key(stamp, &k1, &k2);
+			prng_fill((uint32_t *) (stamp + 1), words, k1, k2);
+		} else {
+			memset(stamp + 1, msc->fill, words * 4);
 		}
+	}
+}
 
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
-
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+static void fill_iov(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count, uint64_t offset, uint64_t generation)
+{
+	unsigned int		i;
 
-		report_progress(msc, MSC_TEST_SG_8SECT);
+	for (i = 0; i < count; i++) {
+		fill_buffer(msc, iov[i].iov_base, iov[i].iov_len, offset,
+				generation);
+		offset += iov[i].iov_len;
 	}
+}
 
-err:
-	return ret;
+/* offset of the first payload byte that isn't @fill, or @len */
+static unsigned check_pattern(const unsigned char *buf, unsigned len,
+		unsigned char fill)
+{
+	unsigned int		i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] != fill)
+			break;
+
+	return i;
 }
 
 /**
- * do_test_sg_2sect - SG write/read/verify 2 sectors at a time
+ * verify_stamps - check every sector of @buf
  * @msc:	Mass Storage Test Context
+ * @buf:	data read back
+ * @bytes:	length of @buf, a multiple of the sector size
+ * @offset:	device offset @buf was read from
+ * @generation:	generation of the write we expect to read back
+ *
+ * A sector with a broken header or a payload that doesn't match what its
+ * header says was written is corrupted, one carrying another LBA is
+ * misplaced and one from an older generation or from a run with another
+ * seed is stale. Newer generations are fine, another request may have
+ * overwritten the same sector in the meantime. Two overlapping writes
+ * are never in flight at once, see queue_write(), so an older
+ * write can't complete after a newer one and look stale.
  */
-static int do_test_sg_2sect(struct usb_msc_test *msc)
+static int verify_stamps(struct usb_msc_test *msc, unsigned char *buf,
+		unsigned bytes, uint64_t offset, uint64_t generation)
 {
-	unsigned char		*txbuf = msc->txbuf;
-	unsigned char		*rxbuf = msc->rxbuf;
-
-	unsigned		len = 2 * msc->sect_size;
+	unsigned		sect_size = msc->sect_size;
+	unsigned		words = (sect_size - sizeof(struct msc_stamp)) / 4;
+	uint64_t		lba = offset / sect_size;
+	unsigned		errors = 0;
+	unsigned int		i;
 
-	off_t			pos;
+	for (i = 0; i < bytes / sect_size; i++) {
+		struct msc_stamp *stamp = (void *) (buf + i * sect_size);
+		const char	*what;
+		unsigned	bad;
+		uint32_t	k1;
+		uint32_t	k2;
+
+		if (stamp->magic != MSC_STAMP_MAGIC ||
+				stamp->crc != stamp_crc(stamp)) {
+			what = "corrupted header";
+		} else if (stamp->lba != lba + i) {
+			what = "misplaced";
+		} else if (stamp->seed != msc->seed ||
+				stamp->generation < generation) {
+			what = "stale";
+		} else {
+			if (stamp->fill == MSC_FILL_PRNG) {
+				prng_key(stamp, &k1, &k2);
+				bad = prng_check((uint32_t *) (stamp + 1),
+						words, k1, k2);
+				if (bad == words)
+					continue;
+			} else {
+				bad = check_pattern((void *) (stamp + 1),
+						words * 4, stamp->fill);
+				if (bad == words * 4)
+					continue;
+			}
 
-	int			ret = 0;
-	int			i;
+			what = "corrupted payload";
+		}
 
-	const struct iovec	tiov[] = {
-		{
-			.iov_base	= txbuf,
-			.iov_len	= len,
-		},
-	};
+		if (errors++ < MSC_STAMP_REPORT)
+			fprintf(stderr, "LBA %llu: %s, holds LBA %llu generation %llu, expected generation %llu\n",
+					(unsigned long long) (lba + i), what,
+					(unsigned long long) stamp->lba,
+					(unsigned long long) stamp->generation,
+					(unsigned long long) generation);
+	}
 
-	const struct iovec	riov[] = {
-		{
-			.iov_base	= rxbuf,
-			.iov_len	= len,
-		},
-	};
+	if (errors > MSC_STAMP_REPORT)
+		fprintf(stderr, "... and %u more bad sectors\n",
+				errors - MSC_STAMP_REPORT);
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+	return errors ? -EIO : 0;
+}
 
-	msc->offset = ret;
+#ifndef RWF_HIPRI
+#define RWF_HIPRI		0x00000001
+#endif
+#ifndef RWF_DSYNC
+#define RWF_DSYNC		0x00000002
+#endif
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT		0x00000008
+#endif
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+/**
+ * map_copy - carry out a request on the --io-mode=mmap mapping
+ * @msc:	Mass Storage Test Context
+ * @iov:	iovec structure pointer
+ * @count:	how many transfers
+ * @offset:	where in the target
+ * @write:	copy to the mapping rather than from it
+ *
+ * Behaves like pwritev()/preadv() at the end of the target: transfers
+ * are cut short there, and nothing at all can be written past it.
+ */
+static ssize_t map_copy(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count, off_t offset, int write)
+{
+	unsigned char		*map = msc->map + offset;
+	size_t			done = 0;
+	uint64_t		start;
+	unsigned int		i;
 
-		ret = do_writev(msc, tiov, 1);
-		if (ret < 0)
-			goto err;
+	if ((uint64_t) offset >= msc->psize)
+		return write ? -ENOSPC : 0;
 
-		pos = lseek(msc->fd, msc->offset - len, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	for (i = 0; i < count && offset + done < msc->psize; i++) {
+		size_t		len = MIN(iov[i].iov_len,
+				msc->psize - offset - done);
 
-		ret = do_readv(msc, riov, 1);
-		if (ret < 0)
-			goto err;
+		if (write)
+			memcpy(map + done, iov[i].iov_base, len);
+		else
+			memcpy(iov[i].iov_base, map + done, len);
 
-		ret = do_verify(msc, len);
-		if (ret < 0)
-			goto err;
+		done += len;
+	}
 
-		report_progress(msc, MSC_TEST_SG_2SECT);
+	if (write && msc->msync_writes) {
+		/* msync() wants a page aligned start */
+		start = offset & ~((uint64_t) getpagesize() - 1);
+		if (msync(msc->map + start, offset + done - start,
+					MS_SYNC) < 0)
+			return -errno;
 	}
 
-err:
-	return ret;
+	return done;
 }
 
 /**
- * do_test_64sect - write/read/verify 64 sectors at a time
+ * msc_pwritev - pwritev2() with the --rwf flags of @msc
  * @msc:	Mass Storage Test Context
+ * @iov:	iovec structure pointer
+ * @count:	how many transfers
+ * @offset:	where to write
+ *
+ * Returns bytes written or negative errno. Without pwritev2() only a
+ * plain pwritev() can be issued, so asking for flags fails. With
+ * --io-mode=mmap the mapping is written instead.
  */
-static int do_test_64sect(struct usb_msc_test *msc)
+static ssize_t msc_pwritev(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count, off_t offset)
 {
-	off_t			pos;
+	ssize_t			ret;
 
-	int			ret = 0;
-	int			i;
-
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
-
-	msc->offset = ret;
+	if (msc->map)
+		return map_copy(msc, iov, count, offset, true);
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+#ifdef HAVE_PWRITEV2
+	ret = pwritev2(msc->fd, iov, count, offset, msc->rwf);
+#else
+	if (msc->rwf)
+		return -EOPNOTSUPP;
 
-		ret = do_write(msc, 64 * msc->sect_size);
-		if (ret < 0)
-			break;
+	ret = pwritev(msc->fd, iov, count, offset);
+#endif
 
-		pos = lseek(msc->fd, msc->offset - 64 * msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	return ret < 0 ? -errno : ret;
+}
 
-		msc->offset = ret;
+/**
+ * msc_preadv - preadv2() with the --rwf flags of @msc
+ * @msc:	Mass Storage Test Context
+ * @iov:	iovec structure pointer
+ * @count:	how many transfers
+ * @offset:	where to read from
+ */
+static ssize_t msc_preadv(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count, off_t offset)
+{
+	ssize_t			ret;
 
-		ret = do_read(msc, 64 * msc->sect_size);
-		if (ret < 0)
-			break;
+	if (msc->map)
+		return map_copy(msc, iov, count, offset, false);
 
-		ret = do_verify(msc, 64 * msc->sect_size);
-		if (ret < 0)
-			break;
+#ifdef HAVE_PREADV2
+	ret = preadv2(msc->fd, iov, count, offset, msc->rwf);
+#else
+	if (msc->rwf)
+		return -EOPNOTSUPP;
 
-		report_progress(msc, MSC_TEST_64SECT);
-	}
+	ret = preadv(msc->fd, iov, count, offset);
+#endif
 
-err:
-	return ret;
+	return ret < 0 ? -errno : ret;
 }
 
 /**
- * do_test_32sect - write/read/verify 32 sectors at a time
+ * do_writev - SG Write txbuf to fd at the next sequential offset
  * @msc:	Mass Storage Test Context
+ * @iov:	iovec structure pointer
+ * @count:	how many transfers
+ *
+ * A write that doesn't fit before the end of the target starts over
+ * from its first sector. RWF_NOWAIT writes that would block are retried.
  */
-static int do_test_32sect(struct usb_msc_test *msc)
+static int do_writev(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count)
 {
-	off_t			pos;
-
-	int			ret = 0;
-	int			i;
-
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+	uint64_t		offset;
+	size_t			len = 0;
+	unsigned int		i;
+	ssize_t			ret;
 
-	msc->offset = ret;
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	if (msc->next + len > msc->base + msc->span)
+		msc->next = msc->base;
+	offset = msc->next;
 
-		ret = do_write(msc, 32 * msc->sect_size);
-		if (ret < 0)
-			break;
+	fill_iov(msc, iov, count, offset, ++msc->generation);
 
-		pos = lseek(msc->fd, msc->offset - 32 * msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
-		}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->start);
+	while ((ret = msc_pwritev(msc, iov, count, offset)) == -EAGAIN &&
+			(msc->rwf & RWF_NOWAIT))
+		msc->eagain++;
+	if (ret < 0)
+		return ret;
 
-		msc->offset = ret;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	if ((size_t) ret != len)
+		return -EIO;
 
-		ret = do_read(msc, 32 * msc->sect_size);
-		if (ret < 0)
-			break;
+	collect_data(msc, &msc->start, &msc->end, ret, true);
+	msc->wr_offset = offset;
+	msc->next = offset + len;
 
-		ret = do_verify(msc, 32 * msc->sect_size);
-		if (ret < 0)
-			break;
+	return 0;
+}
 
-		report_progress(msc, MSC_TEST_32SECT);
-	}
+/**
+ * do_write - Write txbuf to fd
+ * @msc:	Mass Storage Test Context
+ * @bytes:	Amount of bytes to write
+ */
+static int do_write(struct usb_msc_test *msc, unsigned bytes)
+{
+	struct iovec		iov = {
+		.iov_base	= msc->txbuf,
+		.iov_len	= bytes,
+	};
 
-err:
-	return ret;
+	return do_writev(msc, &iov, 1);
 }
 
 /**
- * do_test_8sect - write/read/verify 8 sectors at a time
+ * do_readv - SG Read back what the last write left on the device
  * @msc:	Mass Storage Test Context
+ * @iov:	iovec structure pointer
+ * @count:	how many transfers
  */
-static int do_test_8sect(struct usb_msc_test *msc)
+static int do_readv(struct usb_msc_test *msc, const struct iovec *iov,
+		unsigned count)
 {
-	off_t			pos;
-
-	int			ret = 0;
-	int			i;
+	size_t			len = 0;
+	unsigned int		i;
+	ssize_t			ret;
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+	/* rxbuf still holds what we wrote, don't let a short read pass */
+	for (i = 0; i < count; i++) {
+		memset(iov[i].iov_base, 0x00, iov[i].iov_len);
+		len += iov[i].iov_len;
 	}
 
-	msc->offset = ret;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->start);
+	while ((ret = msc_preadv(msc, iov, count, msc->wr_offset)) ==
+			-EAGAIN && (msc->rwf & RWF_NOWAIT))
+		msc->eagain++;
+	if (ret < 0)
+		return ret;
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	if ((size_t) ret != len)
+		return -EIO;
 
-		ret = do_write(msc, 8 * msc->sect_size);
-		if (ret < 0)
-			goto err;
+	collect_data(msc, &msc->start, &msc->end, ret, false);
+	msc->transferred += ret;
 
-		pos = lseek(msc->fd, msc->offset - 8 * msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
+	return 0;
+}
+
+/**
+ * do_read - Read back to rxbuf what the last write left on the device
+ * @msc:	Mass Storage Test Context
+ * @bytes:	Amount of data to read
+ */
+static int do_read(struct usb_msc_test *msc, unsigned bytes)
+{
+	struct iovec		iov = {
+		.iov_base	= msc->rxbuf,
+		.iov_len	= bytes,
+	};
+
+	return do_readv(msc, &iov, 1);
+}
+
+static void __maybe_unused hexdump(char *buf, unsigned size)
+{
+	unsigned int		i;
+
+	for (i = 0; i < size; i++) {
+		if (i && ((i % 16) == 0))
+			printf("\n");
+		printf("%02x ", buf[i]);
+	}
+	printf("\n");
+}
+
+/**
+ * do_verify - Verify what the last write left on the device
+ * @msc:	Mass Storage Test Context
+ * @bytes:	Amount of data to verify
+ */
+static int do_verify(struct usb_msc_test *msc, unsigned bytes)
+{
+	return verify_stamps(msc, msc->rxbuf, bytes, msc->wr_offset,
+			msc->generation);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const struct msc_engine sync_engine = {
+	.name		= "sync",
+};
+
+/**
+ * struct msc_psync - positional synchronous engine private data
+ * @done:	requests already carried out, waiting to be reaped
+ * @nr_done:	number of valid entries in @done
+ *
+ * Requests are carried out with preadv2()/pwritev2() as soon as they are
+ * queued, so several jobs can share one file descriptor without racing
+ * on its file offset.
+ */
+struct msc_psync {
+	struct msc_io		**done;
+	unsigned		nr_done;
+};
+
+static int psync_init(struct usb_msc_test *msc)
+{
+	struct msc_psync	*psync;
+
+	psync = calloc(1, sizeof(*psync));
+	if (!psync)
+		return -ENOMEM;
+
+	psync->done = calloc(msc->iodepth, sizeof(*psync->done));
+	if (!psync->done) {
+		free(psync);
+		return -ENOMEM;
+	}
+
+	msc->engine_data = psync;
+
+	return 0;
+}
+
+static void psync_exit(struct usb_msc_test *msc)
+{
+	struct msc_psync	*psync = msc->engine_data;
+
+	free(psync->done);
+	free(psync);
+	msc->engine_data = NULL;
+}
+
+static int psync_queue(struct usb_msc_test *msc, struct msc_io *io)
+{
+	struct msc_psync	*psync = msc->engine_data;
+	ssize_t			ret;
+
+	if (io->write)
+		ret = msc_pwritev(msc, io->iov, io->iovcnt, io->offset);
+	else
+		ret = msc_preadv(msc, io->iov, io->iovcnt, io->offset);
+
+	io->result = ret;
+	psync->done[psync->nr_done++] = io;
+
+	return 0;
+}
+
+static int psync_commit(struct usb_msc_test __maybe_unused *msc)
+{
+	return 0;
+}
+
+static int psync_getevents(struct usb_msc_test *msc,
+		unsigned __maybe_unused min, struct msc_io **ios, unsigned max)
+{
+	struct msc_psync	*psync = msc->engine_data;
+	unsigned		n = psync->nr_done;
+
+	if (n > max)
+		n = max;
+
+	memcpy(ios, psync->done, n * sizeof(*ios));
+	psync->nr_done -= n;
+	memmove(psync->done, psync->done + n,
+			psync->nr_done * sizeof(*psync->done));
+
+	return n;
+}
+
+static const struct msc_engine psync_engine = {
+	.name		= "psync",
+	.init		= psync_init,
+	.exit		= psync_exit,
+	.queue		= psync_queue,
+	.commit		= psync_commit,
+	.getevents	= psync_getevents,
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * struct msc_uring - io_uring engine private data
+ * @fd:		ring file descriptor
+ * @fixed:	true when txbuf is registered with the ring
+ * @iopoll:	completions are polled for, --rwf=hipri
+ * @staged:	SQEs filled but not yet handed to the kernel
+ *
+ * The remaining members point into the SQ and CQ rings shared with the
+ * kernel.
+ */
+struct msc_uring {
+	int			fd;
+	int			fixed;
+	int			iopoll;
+	unsigned		staged;
+
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+static int uring_enter(int fd, unsigned submit, unsigned min, unsigned flags)
+{
+	int			ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, fd, submit, min, flags,
+				NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static void uring_unmap(struct msc_uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+			ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+static int uring_init(struct usb_msc_test *msc)
+{
+	struct io_uring_params	p;
+	struct msc_uring	*ring;
+	struct iovec		iov;
+	int			ret;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	memset(&p, 0x00, sizeof(p));
+
+	/* io_uring wants polled I/O asked of the whole ring */
+	if (msc->rwf & RWF_HIPRI) {
+		p.flags |= IORING_SETUP_IOPOLL;
+		ring->iopoll = true;
+	}
+
+	ring->fd = syscall(__NR_io_uring_setup, msc->iodepth, &p);
+	if (ring->fd < 0) {
+		ret = -errno;
+		perror("io_uring_setup");
+		goto err0;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto err1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto err1;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto err1;
+	}
+
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	/*
+	 * Register the buffer so the kernel doesn't have to pin and map
+	 * user pages on every request. This may fail due to RLIMIT_MEMLOCK
+	 * or very large buffers, in which case we just don't use fixed
+	 * buffers.
+	 */
+	iov.iov_base = msc->txbuf;
+	iov.iov_len = (size_t) msc->stride * msc->slots;
+
+	ret = syscall(__NR_io_uring_register, ring->fd,
+			IORING_REGISTER_BUFFERS, &iov, 1);
+	if (ret < 0)
+		fprintf(stderr, "io_uring: not using fixed buffers: %s\n",
+				strerror(errno));
+	else
+		ring->fixed = true;
+
+	msc->engine_data = ring;
+
+	return 0;
+
+err1:
+	uring_unmap(ring);
+	close(ring->fd);
+
+err0:
+	free(ring);
+
+	return ret;
+}
+
+static void uring_exit(struct usb_msc_test *msc)
+{
+	struct msc_uring	*ring = msc->engine_data;
+
+	uring_unmap(ring);
+	close(ring->fd);
+	free(ring);
+	msc->engine_data = NULL;
+}
+
+static int uring_queue(struct usb_msc_test *msc, struct msc_io *io)
+{
+	struct msc_uring	*ring = msc->engine_data;
+	struct io_uring_sqe	*sqe;
+	unsigned		tail = *ring->sq_tail;
+	unsigned		index = tail & *ring->sq_mask;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0x00, sizeof(*sqe));
+
+	sqe->fd = msc->fd;
+	sqe->off = io->offset;
+	sqe->rw_flags = msc->rwf & ~RWF_HIPRI;
+	sqe->user_data = (unsigned long) io;
+
+	if (ring->fixed && io->iovcnt == 1) {
+		sqe->opcode = io->write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long) io->iov[0].iov_base;
+		sqe->len = io->iov[0].iov_len;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long) io->iov;
+		sqe->len = io->iovcnt;
+	}
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->staged++;
+
+	return 0;
+}
+
+static int uring_commit(struct usb_msc_test *msc)
+{
+	struct msc_uring	*ring = msc->engine_data;
+	int			ret;
+
+	while (ring->staged) {
+		ret = uring_enter(ring->fd, ring->staged, 0, 0);
+		if (ret < 0)
+			return ret;
+
+		ring->staged -= ret;
+	}
+
+	return 0;
+}
+
+static int uring_getevents(struct usb_msc_test *msc, unsigned min,
+		struct msc_io **ios, unsigned max)
+{
+	struct msc_uring	*ring = msc->engine_data;
+	unsigned		head = *ring->cq_head;
+	unsigned		tail;
+	unsigned		n = 0;
+	int			ret;
+
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	/* polled completions only show up when we go and reap them */
+	if (tail - head < min || (ring->iopoll && tail == head)) {
+		ret = uring_enter(ring->fd, 0, min, IORING_ENTER_GETEVENTS);
+		if (ret < 0)
+			return ret;
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	while (head != tail && n < max) {
+		struct io_uring_cqe	*cqe;
+		struct msc_io		*io;
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		io = (struct msc_io *) (unsigned long) cqe->user_data;
+		io->result = cqe->res;
+		ios[n++] = io;
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static const struct msc_engine uring_engine = {
+	.name		= "io_uring",
+	.init		= uring_init,
+	.exit		= uring_exit,
+	.queue		= uring_queue,
+	.commit		= uring_commit,
+	.getevents	= uring_getevents,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#ifdef HAVE_LINUX_AIO_ABI_H
+/**
+ * struct msc_aio - native Linux AIO engine private data
+ * @ctx:	AIO context
+ * @iocbs:	one control block per buffer slot
+ * @staged:	control blocks waiting for io_submit()
+ * @nr_staged:	number of valid entries in @staged
+ * @events:	completions returned by io_getevents()
+ */
+struct msc_aio {
+	aio_context_t		ctx;
+	struct iocb		*iocbs;
+	struct iocb		**staged;
+	unsigned		nr_staged;
+	struct io_event		*events;
+};
+
+static int aio_init(struct usb_msc_test *msc)
+{
+	struct msc_aio		*aio;
+	int			ret = -ENOMEM;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio)
+		return -ENOMEM;
+
+	aio->iocbs = calloc(msc->slots, sizeof(*aio->iocbs));
+	if (!aio->iocbs)
+		goto err0;
+
+	aio->staged = calloc(msc->iodepth, sizeof(*aio->staged));
+	if (!aio->staged)
+		goto err1;
+
+	aio->events = calloc(msc->iodepth, sizeof(*aio->events));
+	if (!aio->events)
+		goto err2;
+
+	ret = syscall(__NR_io_setup, msc->iodepth, &aio->ctx);
+	if (ret < 0) {
+		ret = -errno;
+		perror("io_setup");
+		goto err3;
+	}
+
+	msc->engine_data = aio;
+
+	return 0;
+
+err3:
+	free(aio->events);
+
+err2:
+	free(aio->staged);
+
+err1:
+	free(aio->iocbs);
+
+err0:
+	free(aio);
+
+	return ret;
+}
+
+static void aio_exit(struct usb_msc_test *msc)
+{
+	struct msc_aio		*aio = msc->engine_data;
+
+	/* io_destroy() waits for whatever is still in flight */
+	syscall(__NR_io_destroy, aio->ctx);
+	free(aio->events);
+	free(aio->staged);
+	free(aio->iocbs);
+	free(aio);
+	msc->engine_data = NULL;
+}
+
+static int aio_queue(struct usb_msc_test *msc, struct msc_io *io)
+{
+	struct msc_aio		*aio = msc->engine_data;
+	struct iocb		*iocb = &aio->iocbs[io->slot];
+
+	memset(iocb, 0x00, sizeof(*iocb));
+
+	iocb->aio_fildes = msc->fd;
+	iocb->aio_offset = io->offset;
+	iocb->aio_rw_flags = msc->rwf;
+	iocb->aio_data = (unsigned long) io;
+
+	if (io->iovcnt == 1) {
+		iocb->aio_lio_opcode = io->write ? IOCB_CMD_PWRITE :
+			IOCB_CMD_PREAD;
+		iocb->aio_buf = (unsigned long) io->iov[0].iov_base;
+		iocb->aio_nbytes = io->iov[0].iov_len;
+	} else {
+		iocb->aio_lio_opcode = io->write ? IOCB_CMD_PWRITEV :
+			IOCB_CMD_PREADV;
+		iocb->aio_buf = (unsigned long) io->iov;
+		iocb->aio_nbytes = io->iovcnt;
+	}
+
+	aio->staged[aio->nr_staged++] = iocb;
+
+	return 0;
+}
+
+static int aio_commit(struct usb_msc_test *msc)
+{
+	struct msc_aio		*aio = msc->engine_data;
+	unsigned		done = 0;
+	int			ret;
+
+	while (done < aio->nr_staged) {
+		ret = syscall(__NR_io_submit, aio->ctx, aio->nr_staged - done,
+				aio->staged + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		done += ret;
+	}
+
+	aio->nr_staged = 0;
+
+	return 0;
+}
+
+static int aio_getevents(struct usb_msc_test *msc, unsigned min,
+		struct msc_io **ios, unsigned max)
+{
+	struct msc_aio		*aio = msc->engine_data;
+	int			ret;
+	int			i;
+
+	do {
+		ret = syscall(__NR_io_getevents, aio->ctx, min, max,
+				aio->events, NULL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	for (i = 0; i < ret; i++) {
+		struct msc_io	*io;
+
+		io = (struct msc_io *) (unsigned long) aio->events[i].data;
+		io->result = aio->events[i].res;
+		ios[i] = io;
+	}
+
+	return ret;
+}
+
+static const struct msc_engine aio_engine = {
+	.name		= "libaio",
+	.init		= aio_init,
+	.exit		= aio_exit,
+	.queue		= aio_queue,
+	.commit		= aio_commit,
+	.getevents	= aio_getevents,
+};
+#endif /* HAVE_LINUX_AIO_ABI_H */
+
+static const struct msc_engine *msc_engines[] = {
+	&sync_engine,
+	&psync_engine,
+#ifdef HAVE_LINUX_IO_URING_H
+	&uring_engine,
+#endif
+#ifdef HAVE_LINUX_AIO_ABI_H
+	&aio_engine,
+#endif
+};
+
+static const struct msc_engine *find_engine(const char *name)
+{
+	unsigned int		i;
+
+	for (i = 0; i < ARRAY_SIZE(msc_engines); i++)
+		if (!strcmp(msc_engines[i]->name, name))
+			return msc_engines[i];
+
+	return NULL;
+}
+
+/**
+ * engine_init - allocate request slots and set up the I/O engine
+ * @msc:	Mass Storage Test Context
+ */
+static int engine_init(struct usb_msc_test *msc)
+{
+	unsigned int		i;
+	int			ret;
+
+	if (!msc->engine->queue)
+		return 0;
+
+	msc->ios = calloc(msc->slots, sizeof(*msc->ios));
+	if (!msc->ios)
+		return -ENOMEM;
+
+	msc->events = calloc(msc->iodepth, sizeof(*msc->events));
+	if (!msc->events) {
+		ret = -ENOMEM;
+		goto err0;
+	}
+
+	for (i = 0; i < msc->slots; i++)
+		msc->ios[i].slot = i;
+
+	ret = msc->engine->init(msc);
+	if (ret < 0)
+		goto err1;
+
+	return 0;
+
+err1:
+	free(msc->events);
+
+err0:
+	free(msc->ios);
+	msc->ios = NULL;
+
+	return ret;
+}
+
+static void engine_exit(struct usb_msc_test *msc)
+{
+	if (!msc->engine->queue || !msc->ios)
+		return;
+
+	msc->engine->exit(msc);
+	free(msc->events);
+	free(msc->ios);
+	msc->events = NULL;
+	msc->ios = NULL;
+}
+
+/**
+ * prep_io - point @io at its own slot using @iov as a layout template
+ * @msc:	Mass Storage Test Context
+ * @io:		request to prepare
+ * @write:	true for a write, false for a read
+ * @iov:	segment layout relative to txbuf/rxbuf, NULL for one segment
+ * @count:	number of entries in @iov
+ * @len:	total request length
+ *
+ * Test cases describe their SG layout in terms of txbuf and rxbuf; here
+ * each segment is rebased onto the buffer slot owned by @io.
+ */
+static void prep_io(struct usb_msc_test *msc, struct msc_io *io,
+		unsigned write, const struct iovec *iov, unsigned count,
+		unsigned len)
+{
+	unsigned char		*base = write ? msc->txbuf : msc->rxbuf;
+	unsigned char		*slot = base + io->slot * msc->stride;
+	unsigned int		i;
+
+	if (!iov) {
+		io->iov[0].iov_base = slot;
+		io->iov[0].iov_len = len;
+		count = 1;
+	} else {
+		for (i = 0; i < count; i++) {
+			unsigned char	*seg = iov[i].iov_base;
+
+			io->iov[i].iov_base = slot + (seg - base);
+			io->iov[i].iov_len = iov[i].iov_len;
+		}
+	}
+
+	io->iovcnt = count;
+	io->len = len;
+	io->write = write;
+}
+
+static int queue_io(struct usb_msc_test *msc, struct msc_io *io)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, &io->start);
+
+	return msc->engine->queue(msc, io);
+}
+
+/**
+ * retry_nowait - queue @io again if RWF_NOWAIT turned it down
+ * @msc:	Mass Storage Test Context
+ * @io:		completed request
+ *
+ * Returns 1 when @io went back to the engine, 0 when it is really
+ * complete, negative errno on failure.
+ */
+static int retry_nowait(struct usb_msc_test *msc, struct msc_io *io)
+{
+	int			ret;
+
+	if (io->result != -EAGAIN || !(msc->rwf & RWF_NOWAIT))
+		return 0;
+
+	msc->eagain++;
+
+	ret = queue_io(msc, io);
+
+	return ret < 0 ? ret : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* splitmix64, small and good enough to pick offsets */
+static uint64_t rand_u64(uint64_t *state)
+{
+	uint64_t		z;
+
+	z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+/* uniformly distributed in [0, 1) */
+static double rand_double(uint64_t *state)
+{
+	return (rand_u64(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * Zipf sampling by rejection-inversion, see W. Hormann and G. Derflinger,
+ * "Rejection-inversion to generate variates from monotone discrete
+ * distributions". Setup and sampling are O(1), so it works for any
+ * number of blocks.
+ */
+static double zipf_helper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+
+	return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+
+	return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+static double zipf_h(struct msc_zipf *z, double x)
+{
+	return exp(-z->theta * log(x));
+}
+
+static double zipf_hint(struct msc_zipf *z, double x)
+{
+	double			lx = log(x);
+
+	return zipf_helper2((1 - z->theta) * lx) * lx;
+}
+
+static double zipf_hint_inv(struct msc_zipf *z, double x)
+{
+	double			t = x * (1 - z->theta);
+
+	if (t < -1)
+		t = -1;
+
+	return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(struct msc_zipf *z, double theta, uint64_t n)
+{
+	z->theta = theta;
+	z->n = n;
+	z->hx1 = zipf_hint(z, 1.5) - 1;
+	z->hn = zipf_hint(z, n + 0.5);
+	z->s = 2 - zipf_hint_inv(z, zipf_hint(z, 2.5) - zipf_h(z, 2));
+}
+
+/* rank in [1, n], 1 being the most popular */
+static uint64_t zipf_next(struct msc_zipf *z, uint64_t *state)
+{
+	while (true) {
+		double		u;
+		double		x;
+		uint64_t	k;
+
+		u = z->hn + rand_double(state) * (z->hx1 - z->hn);
+		x = zipf_hint_inv(z, u);
+
+		k = x + 0.5;
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+
+		if (k - x <= z->s || u >= zipf_hint(z, k + 0.5) - zipf_h(z, k))
+			return k;
+	}
+}
+
+/**
+ * random_offset - pick a random, @len aligned offset in the random span
+ * @msc:	Mass Storage Test Context
+ * @len:	request length
+ *
+ * Zipf ranks are hashed onto blocks so the hot set is spread over the
+ * span instead of piling up at its start.
+ */
+static uint64_t random_offset(struct usb_msc_test *msc, unsigned len)
+{
+	uint64_t		blocks = msc->zipf.n;
+	uint64_t		block;
+
+	if (msc->dist == MSC_DIST_ZIPF) {
+		uint64_t	rank = zipf_next(&msc->zipf, &msc->rng);
+
+		block = rand_u64(&rank) % blocks;
+	} else {
+		block = rand_u64(&msc->rng) % blocks;
+	}
+
+	return msc->base + block * len;
+}
+
+/* true if [@offset, @offset + @len) overlaps a busy request other than @io */
+static int range_busy(struct usb_msc_test *msc, struct msc_io *io,
+		off_t offset, unsigned len)
+{
+	unsigned int		i;
+
+	for (i = 0; i < msc->slots; i++) {
+		struct msc_io	*other = &msc->ios[i];
+
+		if (other == io || !other->busy)
+			continue;
+
+		if (offset < other->offset + other->len &&
+				other->offset < offset + len)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * random_write_offset - random_offset() for a write, clear of busy ranges
+ * @msc:	Mass Storage Test Context
+ * @io:		request the offset is for
+ * @len:	request length
+ *
+ * Two writes to the same block in flight at once may complete in either
+ * order, and the older one landing last makes the newer one's read back
+ * look stale. A block still owned by another write moves on to the next
+ * free one. That doesn't draw again, so the random sequence stays the
+ * same, and random_init() makes sure there always is a free block.
+ */
+static off_t random_write_offset(struct usb_msc_test *msc,
+		struct msc_io *io, unsigned len)
+{
+	off_t			offset = random_offset(msc, len);
+	off_t			end = msc->base + msc->zipf.n * len;
+
+	while (range_busy(msc, io, offset, len)) {
+		offset += len;
+		if (offset >= end)
+			offset = msc->base;
+	}
+
+	io->busy = true;
+
+	return offset;
+}
+
+/**
+ * check_span - make sure @span has a block of its own for every request
+ * @span:	bytes the requests go to
+ * @len:	request length
+ * @slots:	requests that may be in flight or waiting to be verified
+ *
+ * Two writes to the same block in flight at once may complete in either
+ * order, and the older one landing last makes the newer one's read back
+ * look stale.
+ */
+static int check_span(uint64_t span, unsigned len, unsigned slots)
+{
+	if (span / len < slots) {
+		fprintf(stderr, "--span holds fewer blocks than requests in flight\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * random_init - set up offset generation for random workloads
+ * @msc:	Mass Storage Test Context
+ * @len:	request length
+ */
+static int random_init(struct usb_msc_test *msc, unsigned len)
+{
+	uint64_t		span = msc->span;
+	int			ret;
+
+	if (msc->rnd_span && msc->rnd_span < span)
+		span = msc->rnd_span;
+
+	if (span < len)
+		return -EINVAL;
+
+	ret = check_span(span, len, msc->slots);
+	if (ret < 0)
+		return ret;
+
+	/* every job gets its own, still reproducible, sequence */
+	msc->rng = msc->seed + msc->base;
+	msc->random = true;
+	zipf_init(&msc->zipf, msc->theta, span / len);
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec		ts = {
+		.tv_sec		= ns / 1000000000ULL,
+		.tv_nsec	= ns % 1000000000ULL,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * true once --runtime is over or another device's worker is done, no
+ * new iteration starts after that
+ */
+static int runtime_over(struct usb_msc_test *msc)
+{
+	struct timespec		now;
+
+	if (msc->stop && __atomic_load_n(msc->stop, __ATOMIC_RELAXED))
+		return true;
+
+	if (!msc->runtime)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	return timespec_ns(&msc->begin, &now) >= msc->runtime;
+}
+
+/**
+ * __rate_take - take the tokens for @bytes bytes in @ios requests
+ * @msc:	Mass Storage Test Context
+ * @bytes:	bytes about to be moved
+ * @ios:	requests they take
+ *
+ * Token bucket for --rate, kept as the time at which the bucket holds
+ * enough tokens again. The bucket never holds more than one call worth
+ * of tokens, which paces requests evenly instead of letting them out in
+ * bursts after a stall.
+ *
+ * Returns 0 when the requests may start, otherwise how many ns to wait.
+ */
+static uint64_t __rate_take(struct usb_msc_test *msc, uint64_t bytes,
+		unsigned ios)
+{
+	uint64_t		cost = 0;
+	uint64_t		now;
+
+	if (!msc->rate_bps && !msc->rate_iops)
+		return 0;
+
+	now = now_ns();
+	if (msc->tat > now)
+		return msc->tat - now;
+
+	if (msc->rate_bps)
+		cost = 1000000000ULL * bytes / msc->rate_bps;
+	if (msc->rate_iops && 1000000000ULL * ios / msc->rate_iops > cost)
+		cost = 1000000000ULL * ios / msc->rate_iops;
+
+	/* a full bucket, lateness beyond that isn't made up for */
+	if (msc->tat + cost < now)
+		msc->tat = now - cost;
+
+	msc->tat += cost;
+
+	return 0;
+}
+
+/*
+ * rate_take - __rate_take() for one iteration, which writes and reads
+ * back @len bytes and so costs twice @len or two I/Os
+ */
+static uint64_t rate_take(struct usb_msc_test *msc, unsigned len)
+{
+	return __rate_take(msc, 2ULL * len, 2);
+}
+
+static void rate_wait(struct usb_msc_test *msc, unsigned len)
+{
+	uint64_t		delay;
+
+	while ((delay = rate_take(msc, len)))
+		sleep_ns(delay);
+}
+
+/**
+ * seq_write_offset - next sequential offset, clear of busy ranges
+ * @msc:	Mass Storage Test Context
+ * @io:		request the offset is for
+ * @len:	request length
+ *
+ * Once writes wrap around the span, a slow request may still own the
+ * block they come back to. Like random_write_offset(), that block is
+ * skipped for the next free one, which check_span() makes sure exists.
+ */
+static off_t seq_write_offset(struct usb_msc_test *msc, struct msc_io *io,
+		unsigned len)
+{
+	uint64_t		tries = msc->span / len;
+	off_t			offset;
+
+	do {
+		if (msc->next + len > msc->base + msc->span)
+			msc->next = msc->base;
+
+		offset = msc->next;
+		msc->next += len;
+	} while (range_busy(msc, io, offset, len) && tries--);
+
+	io->busy = true;
+
+	return offset;
+}
+
+/**
+ * queue_write - queue a write of @len bytes at the next offset
+ * @msc:	Mass Storage Test Context
+ * @io:		request to use
+ * @iov:	tx layout template, NULL for one segment
+ * @count:	number of entries in @iov
+ * @len:	total request length
+ */
+static int queue_write(struct usb_msc_test *msc, struct msc_io *io,
+		const struct iovec *iov, unsigned count, unsigned len)
+{
+	if (msc->random)
+		io->offset = random_write_offset(msc, io, len);
+	else
+		io->offset = seq_write_offset(msc, io, len);
+
+	prep_io(msc, io, true, iov, count, len);
+
+	io->generation = ++msc->generation;
+	fill_iov(msc, io->iov, io->iovcnt, io->offset, io->generation);
+
+	return queue_io(msc, io);
+}
+
+/**
+ * queue_read - queue a read back of what @io has just written
+ * @msc:	Mass Storage Test Context
+ * @io:		completed write request
+ * @iov:	rx layout template, NULL for one segment
+ * @count:	number of entries in @iov
+ */
+static int queue_read(struct usb_msc_test *msc, struct msc_io *io,
+		const struct iovec *iov, unsigned count)
+{
+	memset(msc->rxbuf + io->slot * msc->stride, 0x00, io->len);
+	prep_io(msc, io, false, iov, count, io->len);
+
+	return queue_io(msc, io);
+}
+
+/**
+ * io_error - report a queued request that failed or came up short
+ * @io:		completed request
+ *
+ * Returns the error the run fails with.
+ */
+static int io_error(struct msc_io *io)
+{
+	const char		*dir = io->write ? "write" : "read";
+
+	if (io->result < 0) {
+		fprintf(stderr, "%s at offset %llu: %s\n", dir,
+				(unsigned long long) io->offset,
+				strerror(-io->result));
+		return io->result;
+	}
+
+	fprintf(stderr, "short %s at offset %llu: %d of %u bytes\n", dir,
+			(unsigned long long) io->offset, io->result, io->len);
+
+	return -EIO;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/**
+ * struct msc_spsc - lock-free single producer, single consumer ring
+ * @entries:	ring storage
+ * @mask:	number of entries minus one, entries is a power of two
+ * @head:	next entry to consume, only written by the consumer
+ * @tail:	next entry to produce, only written by the producer
+ *
+ * The producer publishes an entry with a release store of @tail and the
+ * consumer gives it back with a release store of @head, so neither side
+ * ever takes a lock. Head and tail live on their own cache lines.
+ */
+struct msc_spsc {
+	struct msc_io		**entries;
+	unsigned		mask;
+	unsigned		head __attribute__((aligned(64)));
+	unsigned		tail __attribute__((aligned(64)));
+};
+
+static int spsc_init(struct msc_spsc *ring, unsigned entries)
+{
+	unsigned		size = 1;
+
+	while (size < entries)
+		size <<= 1;
+
+	ring->entries = calloc(size, sizeof(*ring->entries));
+	if (!ring->entries)
+		return -ENOMEM;
+
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return 0;
+}
+
+static int spsc_push(struct msc_spsc *ring, struct msc_io *io)
+{
+	unsigned		tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+		return false;
+
+	ring->entries[tail & ring->mask] = io;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static struct msc_io *spsc_pop(struct msc_spsc *ring)
+{
+	unsigned		head = ring->head;
+	struct msc_io		*io;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	io = ring->entries[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return io;
+}
+
+/**
+ * struct msc_verifier - verification stage running next to the I/O loop
+ * @thread:	verification thread
+ * @msc:	Mass Storage Test Context it verifies for
+ * @todo:	completed reads, I/O loop to verifier
+ * @done:	verified slots, verifier to I/O loop, io->result < 0 on failure
+ * @stop:	set by the I/O loop when it won't push anything else
+ *
+ * Both rings are sized for every slot, so a push never fails.
+ */
+struct msc_verifier {
+	pthread_t		thread;
+	struct usb_msc_test	*msc;
+	struct msc_spsc		todo;
+	struct msc_spsc		done;
+	int			stop;
+};
+
+static void *verifier_thread(void *data)
+{
+	struct msc_verifier	*v = data;
+	struct usb_msc_test	*msc = v->msc;
+
+	while (true) {
+		struct msc_io	*io = spsc_pop(&v->todo);
+		int		ret;
+
+		if (!io) {
+			if (__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE))
+				break;
+
+			sched_yield();
+			continue;
+		}
+
+		ret = verify_stamps(msc, msc->rxbuf + io->slot * msc->stride,
+				io->len, io->offset, io->generation);
+		if (ret < 0)
+			io->result = ret;
+
+		spsc_push(&v->done, io);
+	}
+
+	return NULL;
+}
+
+static int verifier_start(struct usb_msc_test *msc, struct msc_verifier *v)
+{
+	int			ret;
+
+	v->msc = msc;
+	v->stop = false;
+
+	ret = spsc_init(&v->todo, msc->slots);
+	if (ret < 0)
+		goto err0;
+
+	ret = spsc_init(&v->done, msc->slots);
+	if (ret < 0)
+		goto err1;
+
+	ret = pthread_create(&v->thread, NULL, verifier_thread, v);
+	if (ret) {
+		ret = -ret;
+		goto err2;
+	}
+
+	return 0;
+
+err2:
+	free(v->done.entries);
+
+err1:
+	free(v->todo.entries);
+
+err0:
+	return ret;
+}
+
+static void verifier_stop(struct msc_verifier *v)
+{
+	__atomic_store_n(&v->stop, true, __ATOMIC_RELEASE);
+	pthread_join(v->thread, NULL);
+	free(v->done.entries);
+	free(v->todo.entries);
+}
+
+/**
+ * do_test_queued - write/read/verify keeping iodepth requests in flight
+ * @msc:	Mass Storage Test Context
+ * @test:	test case number, for progress report
+ * @tiov:	tx layout template, NULL for one segment
+ * @tcount:	number of entries in @tiov
+ * @riov:	rx layout template, NULL for one segment
+ * @rcount:	number of entries in @riov
+ * @len:	bytes moved by each request
+ *
+ * Every slot cycles through write, read back and verify on its own, so
+ * the queue never drains while there are iterations left. An iteration
+ * is one such cycle.
+ *
+ * With --verify-pool there are that many slots on top of iodepth and
+ * completed reads are handed to a verification thread, while free slots
+ * keep iodepth requests in flight. Otherwise reads are verified inline.
+ */
+static int do_test_queued(struct usb_msc_test *msc,
+		enum usb_msc_test_case test, const struct iovec *tiov,
+		unsigned tcount, const struct iovec *riov, unsigned rcount,
+		unsigned len)
+{
+	const struct msc_engine	*engine = msc->engine;
+	struct msc_verifier	verifier;
+	struct msc_io		**free_ios;
+	struct msc_io		*io;
+	unsigned		nr_free = 0;
+	unsigned		count = msc->count;
+	unsigned		issued = 0;
+	unsigned		completed = 0;
+	unsigned		inflight = 0;
+	unsigned int		i;
+	int			ret = 0;
+
+	free_ios = calloc(msc->slots, sizeof(*free_ios));
+	if (!free_ios)
+		return -ENOMEM;
+
+	for (i = msc->slots; i > 0; i--) {
+		msc->ios[i - 1].busy = false;
+		free_ios[nr_free++] = &msc->ios[i - 1];
+	}
+
+	if (msc->verify_pool) {
+		ret = verifier_start(msc, &verifier);
+		if (ret < 0)
+			goto err0;
+	}
+
+	while (completed < count) {
+		unsigned	min = msc->batch;
+		uint64_t	delay = 0;
+		int		events;
+
+		/* slots coming back from the verifier are free again */
+		while (msc->verify_pool && (io = spsc_pop(&verifier.done))) {
+			if (io->result < 0) {
+				ret = io->result;
+				goto err1;
+			}
+
+			completed++;
+			report_progress(msc, test);
+			io->busy = false;
+			free_ios[nr_free++] = io;
+		}
+
+		/* once --runtime is over, finish what was started */
+		if (issued < count && runtime_over(msc))
+			count = issued;
+
+		while (inflight < msc->iodepth && issued < count && nr_free) {
+			delay = rate_take(msc, len);
+			if (delay)
+				break;
+
+			ret = queue_write(msc, free_ios[--nr_free], tiov,
+					tcount, len);
+			if (ret < 0)
+				goto err1;
+
+			issued++;
+			inflight++;
+		}
+
+		if (!inflight) {
+			/* out of tokens, or everything left is being verified */
+			if (delay)
+				sleep_ns(delay);
+			else if (completed < count)
+				sched_yield();
+			continue;
+		}
+
+		if (min > inflight)
+			min = inflight;
+
+		ret = engine->commit(msc);
+		if (ret < 0)
+			goto err1;
+
+		events = engine->getevents(msc, min, msc->events,
+				msc->iodepth);
+		if (events < 0) {
+			ret = events;
+			goto err1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+
+		for (i = 0; i < (unsigned) events; i++) {
+			io = msc->events[i];
+
+			ret = retry_nowait(msc, io);
+			if (ret < 0)
+				goto err1;
+			if (ret)
+				continue;
+
+			if (io->result != (int) io->len) {
+				ret = io_error(io);
+				goto err1;
+			}
+
+			collect_data(msc, &io->start, &msc->end, io->result,
+					io->write);
+
+			if (io->write) {
+				ret = queue_read(msc, io, riov, rcount);
+				if (ret < 0)
+					goto err1;
+				continue;
+			}
+
+			msc->transferred += io->result;
+			inflight--;
+
+			if (msc->verify_pool) {
+				spsc_push(&verifier.todo, io);
+				continue;
+			}
+
+			ret = verify_stamps(msc, msc->rxbuf +
+					io->slot * msc->stride, io->len,
+					io->offset, io->generation);
+			if (ret < 0)
+				goto err1;
+
+			completed++;
+			report_progress(msc, test);
+			io->busy = false;
+			free_ios[nr_free++] = io;
+		}
+	}
+
+err1:
+	if (msc->verify_pool)
+		verifier_stop(&verifier);
+
+err0:
+	free(free_ios);
+
+	return ret;
+}
+
+/**
+ * do_test_rwmix - independent reads and writes at random offsets
+ * @msc:	Mass Storage Test Context
+ *
+ * Every request is a read with --rwmix percent probability, a write
+ * otherwise, each with its own size, and iodepth of them stay in flight
+ * regardless of direction. An iteration is one request. Offsets are
+ * random and aligned to the larger of both sizes.
+ *
+ * A read may land anywhere, so it's only verified when --precondition
+ * stamped the whole target first, and then only against itself: any
+ * generation is accepted, a concurrent write may have won the race.
+ */
+static int do_test_rwmix(struct usb_msc_test *msc)
+{
+	const struct msc_engine	*engine = msc->engine;
+	struct msc_io		**free_ios;
+	struct msc_io		*io;
+	unsigned		len = MAX(msc->read_size, msc->write_size);
+	unsigned		nr_free = 0;
+	unsigned		count = msc->count;
+	unsigned		issued = 0;
+	unsigned		completed = 0;
+	unsigned		inflight = 0;
+	unsigned int		i;
+	int			ret;
+
+	if (!engine->queue)
+		return -EINVAL;
+
+	if (msc->read_size % msc->sect_size ||
+			msc->write_size % msc->sect_size) {
+		fprintf(stderr, "--read-size and --write-size must be whole sectors\n");
+		return -EINVAL;
+	}
+
+	ret = random_init(msc, len);
+	if (ret < 0)
+		return ret;
+
+	free_ios = calloc(msc->slots, sizeof(*free_ios));
+	if (!free_ios) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = msc->slots; i > 0; i--) {
+		msc->ios[i - 1].busy = false;
+		free_ios[nr_free++] = &msc->ios[i - 1];
+	}
+
+	while (completed < count) {
+		uint64_t	delay = 0;
+		int		events;
+
+		if (issued < count && runtime_over(msc))
+			count = issued;
+
+		while (inflight < msc->iodepth && issued < count && nr_free) {
+			int	read = rand_u64(&msc->rng) % 100 < msc->rwmix;
+			unsigned size = read ? msc->read_size : msc->write_size;
+
+			delay = __rate_take(msc, size, 1);
+			if (delay)
+				break;
+
+			/* reads accept any generation, only writes must not overlap */
+			io = free_ios[--nr_free];
+			if (read)
+				io->offset = random_offset(msc, len);
+			else
+				io->offset = random_write_offset(msc, io, len);
+			prep_io(msc, io, !read, NULL, 0, size);
+
+			if (read) {
+				memset(msc->rxbuf + io->slot * msc->stride,
+						0x00, size);
+			} else {
+				io->generation = ++msc->generation;
+				fill_iov(msc, io->iov, io->iovcnt, io->offset,
+						io->generation);
+			}
+
+			ret = queue_io(msc, io);
+			if (ret < 0)
+				goto err;
+
+			issued++;
+			inflight++;
+		}
+
+		if (!inflight) {
+			if (delay)
+				sleep_ns(delay);
+			continue;
+		}
+
+		ret = engine->commit(msc);
+		if (ret < 0)
+			goto err;
+
+		events = engine->getevents(msc, MIN(msc->batch, inflight),
+				msc->events, msc->iodepth);
+		if (events < 0) {
+			ret = events;
+			goto err;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+
+		for (i = 0; i < (unsigned) events; i++) {
+			io = msc->events[i];
+
+			ret = retry_nowait(msc, io);
+			if (ret < 0)
+				goto err;
+			if (ret)
+				continue;
+
+			if (io->result != (int) io->len) {
+				ret = io_error(io);
+				goto err;
+			}
+
+			collect_data(msc, &io->start, &msc->end, io->result,
+					io->write);
+			msc->transferred += io->result;
+			inflight--;
+
+			if (!io->write && msc->precondition) {
+				ret = verify_stamps(msc, msc->rxbuf +
+						io->slot * msc->stride,
+						io->len, io->offset, 0);
+				if (ret < 0)
+					goto err;
+			}
+
+			completed++;
+			report_progress(msc, MSC_TEST_RWMIX);
+			io->busy = false;
+			free_ios[nr_free++] = io;
+		}
+	}
+
+	ret = 0;
+
+err:
+	free(free_ios);
+
+out:
+	msc->random = false;
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/**
+ * do_test_write_past_last - attempt to write past last sector
+ * @msc:	Mass Storage Test Context
+ */
+static int do_test_write_past_last(struct usb_msc_test *msc)
+{
+	struct iovec		iov = {
+		.iov_base	= msc->txbuf,
+		.iov_len	= msc->size,
+	};
+	ssize_t			ret = 0;
+	int			i;
+
+	for (i = 0; i < msc->count; i++) {
+		/* start one sector less than needed before the end */
+		ret = msc_pwritev(msc, &iov, 1, msc->psize - msc->size +
+				msc->sect_size);
+		if (ret == (ssize_t) msc->size) {
+			ret = -EINVAL;
+			goto err;
+		}
+		ret = 0;
+
+		report_progress(msc, MSC_TEST_WRITE_PAST_LAST);
+	}
+
+err:
+	return ret;
+}
+
+/**
+ * do_test_lseek_past_last - attempt to read starting past the last sector
+ * @msc:	Mass Storage Test Context
+ */
+static int do_test_lseek_past_last(struct usb_msc_test *msc)
+{
+	off_t			pos;
+
+	int			ret = 0;
+	int			i;
+
+	for (i = 0; i < msc->count; i++) {
+		pos = lseek(msc->fd, msc->psize + msc->sect_size,
+				SEEK_SET);
+		if (pos >= 0) {
+			ret = -EINVAL;
+			goto err;
+		}
+
+		report_progress(msc, MSC_TEST_LSEEK_PAST_LAST);
+	}
+
+err:
+	return ret;
+}
+
+/**
+ * do_test_read_past_last - attempt to read past last sector
+ * @msc:	Mass Storage Test Context
+ */
+static int do_test_read_past_last(struct usb_msc_test *msc)
+{
+	struct iovec		iov = {
+		.iov_base	= msc->rxbuf,
+		.iov_len	= msc->size,
+	};
+	ssize_t			ret = 0;
+	int			i;
+
+	for (i = 0; i < msc->count; i++) {
+		/* start one sector less than needed before the end */
+		ret = msc_preadv(msc, &iov, 1, msc->psize - msc->size +
+				msc->sect_size);
+		if (ret == (ssize_t) msc->size) {
+			ret = -EINVAL;
+			goto err;
+		}
+		ret = 0;
+
+		report_progress(msc, MSC_TEST_READ_PAST_LAST);
+	}
+
+err:
+	return ret;
+}
+
+/*
+ * Discard ioctls from <linux/fs.h>, which doesn't mix well with
+ * <sys/mount.h> on every libc.
+ */
+#ifndef BLKDISCARD
+#define BLKDISCARD		_IO(0x12, 119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD		_IO(0x12, 125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT		_IO(0x12, 127)
+#endif
+
+/* next range for a discard test, --discard-offset past the usual spot */
+static uint64_t discard_offset(struct usb_msc_test *msc, unsigned len)
+{
+	uint64_t		offset;
+
+	if (msc->next + msc->discard_offset + len > msc->base + msc->span)
+		msc->next = msc->base;
+
+	offset = msc->next + msc->discard_offset;
+	msc->next += len;
+
+	return offset;
+}
+
+/**
+ * discard_range - issue @req on @len bytes at @offset, timed
+ * @msc:	Mass Storage Test Context
+ * @req:	BLKDISCARD, BLKSECDISCARD or BLKZEROOUT
+ * @offset:	first byte
+ * @len:	bytes to discard
+ */
+static int discard_range(struct usb_msc_test *msc, unsigned long req,
+		uint64_t offset, uint64_t len)
+{
+	uint64_t		range[2] = { offset, len };
+	struct timespec		start;
+	struct timespec		end;
+	int			ret;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	ret = ioctl(msc->fd, req, range);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+	if (ret < 0)
+		return -errno;
+
+	stats_add(&msc->discard, timespec_ns(&start, &end), len);
+	msc->transferred += len;
+	msc->end = end;
+
+	return 0;
+}
+
+/* read back @len bytes at @offset, which must all be zero */
+static int check_zeroes(struct usb_msc_test *msc, uint64_t offset,
+		unsigned len)
+{
+	unsigned char		*buf = msc->rxbuf;
+	struct timespec		start;
+	unsigned		errors = 0;
+	unsigned int		i;
+	ssize_t			ret;
+
+	/* no stale zeroes from an earlier request */
+	memset(buf, 0xff, len);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	ret = pread(msc->fd, buf, len, offset);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+
+	collect_data(msc, &start, &msc->end, len, false);
+	msc->transferred += len;
+
+	for (i = 0; i < len; i += msc->sect_size) {
+		if (check_pattern(buf + i, msc->sect_size, 0x00) ==
+				msc->sect_size)
+			continue;
+
+		if (errors++ < MSC_STAMP_REPORT)
+			fprintf(stderr, "LBA %llu: not zeroed\n",
+					(unsigned long long)
+					((offset + i) / msc->sect_size));
+	}
+
+	if (errors > MSC_STAMP_REPORT)
+		fprintf(stderr, "... and %u more bad sectors\n",
+				errors - MSC_STAMP_REPORT);
+
+	return errors ? -EIO : 0;
+}
+
+/* write @len stamped bytes at @offset, read them back and verify */
+static int rewrite_range(struct usb_msc_test *msc, uint64_t offset,
+		unsigned len)
+{
+	unsigned char		*buf = msc->txbuf;
+	struct timespec		start;
+	ssize_t			ret;
+
+	fill_buffer(msc, buf, len, offset, ++msc->generation);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	ret = pwrite(msc->fd, buf, len, offset);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+
+	collect_data(msc, &start, &msc->end, len, true);
+
+	/* rxbuf is txbuf, don't let a short read pass */
+	memset(buf, 0x00, len);
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	ret = pread(msc->fd, buf, len, offset);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+
+	collect_data(msc, &start, &msc->end, len, false);
+	msc->transferred += len;
+
+	return verify_stamps(msc, buf, len, offset, msc->generation);
+}
+
+/**
+ * discard_loop - discard --size bytes per iteration
+ * @msc:	Mass Storage Test Context
+ * @test:	test case number, for progress report
+ * @req:	BLKDISCARD, BLKSECDISCARD or BLKZEROOUT
+ * @rewrite:	write the range again right after discarding it
+ *
+ * Ranges follow each other like sequential writes do, shifted by
+ * --discard-offset to see what discards misaligned to the device's
+ * granularity cost. With --verify-zeroes every range is read back and
+ * must be all zeroes, which only BLKZEROOUT guarantees.
+ */
+static int discard_loop(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		unsigned long req, int rewrite)
+{
+	uint64_t		offset;
+	int			ret = 0;
+	int			i;
+
+	if (msc->discard_offset % msc->sect_size ||
+			msc->discard_offset + msc->size > msc->span) {
+		fprintf(stderr, "--discard-offset must be whole sectors within the device\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < msc->count && !runtime_over(msc); i++) {
+		rate_wait(msc, msc->size);
+
+		offset = discard_offset(msc, msc->size);
+
+		ret = discard_range(msc, req, offset, msc->size);
+		if (ret < 0) {
+			fprintf(stderr, "LBA %llu: discard failed: %s\n",
+					(unsigned long long)
+					(offset / msc->sect_size),
+					strerror(-ret));
+			break;
+		}
+
+		if (msc->verify_zeroes) {
+			ret = check_zeroes(msc, offset, msc->size);
+			if (ret < 0)
+				break;
+		}
+
+		if (rewrite) {
+			ret = rewrite_range(msc, offset, msc->size);
+			if (ret < 0)
+				break;
+		}
+
+		report_progress(msc, test);
+	}
+
+	return ret;
+}
+
+static int do_test_discard(struct usb_msc_test *msc)
+{
+	return discard_loop(msc, MSC_TEST_DISCARD, BLKDISCARD, false);
+}
+
+static int do_test_secdiscard(struct usb_msc_test *msc)
+{
+	return discard_loop(msc, MSC_TEST_SECDISCARD, BLKSECDISCARD, false);
+}
+
+static int do_test_zeroout(struct usb_msc_test *msc)
+{
+	return discard_loop(msc, MSC_TEST_ZEROOUT, BLKZEROOUT, false);
+}
+
+static int do_test_discard_write(struct usb_msc_test *msc)
+{
+	return discard_loop(msc, MSC_TEST_DISCARD_WRITE, BLKDISCARD, true);
+}
+
+/* layout of the random SG test cases, in sectors per segment */
+static const unsigned msc_sg_random[] = { 8, 1, 3, 32, 20, 14, 16, 34, 0 };
+
+#define MSC_DESC_VECTORED	(1 << 0) /* readv()/writev() on the sync engine */
+#define MSC_DESC_PATTERN	(1 << 1) /* payload filled with --pattern */
+#define MSC_DESC_RANDOM		(1 << 2) /* random offsets, queued engines only */
+#define MSC_DESC_DEVICE		(1 << 3) /* end of device, block devices only */
+#define MSC_DESC_BLOCK		(1 << 4) /* block device ioctls */
+
+/**
+ * struct msc_test_desc - what a test case does
+ * @name:	short description
+ * @sectors:	sectors per request, 0 for --size bytes
+ * @tx_sg:	write layout in sectors per segment, 0 terminated
+ * @rx_sg:	read layout in sectors per segment, 0 terminated
+ * @flags:	MSC_DESC_*
+ * @run:	for the few cases which aren't write, read back and verify
+ *
+ * A NULL layout means one segment covering the whole request.
+ */
+struct msc_test_desc {
+	const char		*name;
+	unsigned		sectors;
+	const unsigned		*tx_sg;
+	const unsigned		*rx_sg;
+	unsigned		flags;
+	int			(*run)(struct usb_msc_test *msc);
+};
+
+static const struct msc_test_desc msc_tests[] = {
+	[MSC_TEST_SIMPLE] = {
+		.name		= "simple read/write",
+	},
+	[MSC_TEST_1SECT] = {
+		.name		= "1-sector read/write",
+		.sectors	= 1,
+	},
+	[MSC_TEST_8SECT] = {
+		.name		= "8-sectors read/write",
+		.sectors	= 8,
+	},
+	[MSC_TEST_32SECT] = {
+		.name		= "32-sectors read/write",
+		.sectors	= 32,
+	},
+	[MSC_TEST_64SECT] = {
+		.name		= "64-sectors read/write",
+		.sectors	= 64,
+	},
+	[MSC_TEST_SG_2SECT] = {
+		.name		= "scatter/gather for 2-sectors",
+		.sectors	= 2,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_8SECT] = {
+		.name		= "scatter/gather for 8-sectors",
+		.sectors	= 8,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_32SECT] = {
+		.name		= "scatter/gather for 32-sectors",
+		.sectors	= 32,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_64SECT] = {
+		.name		= "scatter/gather for 64-sectors",
+		.sectors	= 64,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_128SECT] = {
+		.name		= "scatter/gather for 128-sectors",
+		.sectors	= 128,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_READ_PAST_LAST] = {
+		.name		= "read over the end of the device",
+		.flags		= MSC_DESC_DEVICE,
+		.run		= do_test_read_past_last,
+	},
+	[MSC_TEST_LSEEK_PAST_LAST] = {
+		.name		= "lseek past the end of the device",
+		.flags		= MSC_DESC_DEVICE,
+		.run		= do_test_lseek_past_last,
+	},
+	[MSC_TEST_WRITE_PAST_LAST] = {
+		.name		= "write over the end of the device",
+		.flags		= MSC_DESC_DEVICE,
+		.run		= do_test_write_past_last,
+	},
+	[MSC_TEST_SG_RANDOM_READ] = {
+		.name		= "write 1 sg, read 8 random size sgs",
+		.sectors	= 128,
+		.rx_sg		= msc_sg_random,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_RANDOM_WRITE] = {
+		.name		= "write 8 random size sgs, read 1 sg",
+		.sectors	= 128,
+		.tx_sg		= msc_sg_random,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_SG_RANDOM_BOTH] = {
+		.name		= "write and read 8 random size sgs",
+		.sectors	= 128,
+		.tx_sg		= msc_sg_random,
+		.rx_sg		= msc_sg_random,
+		.flags		= MSC_DESC_VECTORED,
+	},
+	[MSC_TEST_PATTERNS] = {
+		.name		= "write known pattern and read it back",
+		.flags		= MSC_DESC_PATTERN,
+	},
+	[MSC_TEST_RANDOM] = {
+		.name		= "random offsets read/write",
+		.flags		= MSC_DESC_RANDOM,
+	},
+	[MSC_TEST_DISCARD] = {
+		.name		= "discard",
+		.flags		= MSC_DESC_BLOCK,
+		.run		= do_test_discard,
+	},
+	[MSC_TEST_SECDISCARD] = {
+		.name		= "secure discard",
+		.flags		= MSC_DESC_BLOCK,
+		.run		= do_test_secdiscard,
+	},
+	[MSC_TEST_ZEROOUT] = {
+		.name		= "write zeroes",
+		.flags		= MSC_DESC_BLOCK,
+		.run		= do_test_zeroout,
+	},
+	[MSC_TEST_DISCARD_WRITE] = {
+		.name		= "discard, then write and read back",
+		.flags		= MSC_DESC_BLOCK,
+		.run		= do_test_discard_write,
+	},
+	[MSC_TEST_RWMIX] = {
+		.name		= "mixed random reads and writes",
+		.flags		= MSC_DESC_RANDOM,
+		.run		= do_test_rwmix,
+	},
+};
+
+static const struct msc_test_desc *find_test(enum usb_msc_test_case test)
+{
+	if ((unsigned) test >= ARRAY_SIZE(msc_tests) || !msc_tests[test].name)
+		return NULL;
+
+	return &msc_tests[test];
+}
+
+/**
+ * build_iov - lay out @len bytes of @buf as described by @sg
+ * @iov:	iovec array, MSC_MAX_SEGMENTS entries
+ * @buf:	txbuf or rxbuf
+ * @sg:	sectors per segment, 0 terminated, NULL for a single segment
+ * @sect_size:	sector size
+ * @len:	request length
+ *
+ * Returns the number of segments.
+ */
+static unsigned build_iov(struct iovec *iov, unsigned char *buf,
+		const unsigned *sg, unsigned sect_size, unsigned len)
+{
+	unsigned		offset = 0;
+	unsigned int		i;
+
+	if (!sg) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = len;
+
+		return 1;
+	}
+
+	for (i = 0; sg[i] && i < MSC_MAX_SEGMENTS; i++) {
+		iov[i].iov_base = buf + offset;
+		iov[i].iov_len = sg[i] * sect_size;
+		offset += iov[i].iov_len;
+	}
+
+	return i;
+}
+
+/* split @len bytes of @buf into @count equal segments */
+static unsigned split_iov(struct iovec *iov, unsigned char *buf,
+		unsigned count, unsigned len)
+{
+	unsigned int		i;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = buf + i * (len / count);
+		iov[i].iov_len = len / count;
+	}
+
+	return count;
+}
+
+/**
+ * do_test_desc - write, read back and verify as described by @test
+ * @msc:	Mass Storage Test Context
+ * @test:	test case number
+ *
+ * Queued engines keep iodepth requests in flight, the sync engine writes,
+ * seeks back, reads and verifies one request at a time. A segment count
+ * set by --sweep-sg replaces the test's own layout.
+ */
+static int do_test_desc(struct usb_msc_test *msc, enum usb_msc_test_case test)
+{
+	const struct msc_test_desc *desc = &msc_tests[test];
+	struct iovec		tiov[MSC_MAX_SEGMENTS];
+	struct iovec		riov[MSC_MAX_SEGMENTS];
+	unsigned		vectored = desc->flags & MSC_DESC_VECTORED;
+	unsigned		tcount;
+	unsigned		rcount;
+	unsigned		len;
+
+	int			ret = 0;
+	int			i;
+
+	len = desc->sectors ? desc->sectors * msc->sect_size : msc->size;
+	if (len > msc->stride) {
+		fprintf(stderr, "test %d needs a buffer of at least %u bytes\n",
+				test, len);
+		return -EINVAL;
+	}
+
+	if (msc->segments) {
+		tcount = split_iov(tiov, msc->txbuf, msc->segments, len);
+		rcount = split_iov(riov, msc->rxbuf, msc->segments, len);
+		vectored = true;
+	} else {
+		tcount = build_iov(tiov, msc->txbuf, desc->tx_sg,
+				msc->sect_size, len);
+		rcount = build_iov(riov, msc->rxbuf, desc->rx_sg,
+				msc->sect_size, len);
+	}
+
+	if (desc->flags & MSC_DESC_RANDOM) {
+		if (!msc->engine->queue)
+			return -EINVAL;
+
+		ret = random_init(msc, len);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (desc->flags & MSC_DESC_PATTERN)
+		msc->fill = msc_patterns[msc->pattern];
+
+	if (msc->engine->queue) {
+		ret = do_test_queued(msc, test, tiov, tcount, riov, rcount,
+				len);
+		goto out;
+	}
+
+	for (i = 0; i < msc->count && !runtime_over(msc); i++) {
+		rate_wait(msc, len);
+
+		if (vectored)
+			ret = do_writev(msc, tiov, tcount);
+		else
+			ret = do_write(msc, len);
+		if (ret < 0)
+			goto out;
+
+		if (vectored)
+			ret = do_readv(msc, riov, rcount);
+		else
+			ret = do_read(msc, len);
+		if (ret < 0)
+			goto out;
+
+		ret = do_verify(msc, len);
+		if (ret < 0)
+			goto out;
+
+		report_progress(msc, test);
+	}
+
+out:
+	msc->fill = MSC_FILL_PRNG;
+	msc->random = false;
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/**
+ * __do_test - Write, Read and Verify, without reporting the outcome
+ * @msc:	Mass Storage Test Context
+ * @test:	test number
+ */
+static int __do_test(struct usb_msc_test *msc, enum usb_msc_test_case test)
+{
+	const struct msc_test_desc *desc = find_test(test);
+
+	if (!desc) {
+		printf("%s: test %d is not supported\n",
+				__func__, test);
+		return -ENOTSUP;
+	}
+
+	if (desc->run)
+		return desc->run(msc);
+
+	return do_test_desc(msc, test);
+}
+
+/* --precondition fills the target with requests this large, this deep */
+#define MSC_PRECOND_SIZE	(1U << 20)
+#define MSC_PRECOND_DEPTH	32
+
+/**
+ * precondition - write the whole target once, sequentially
+ * @msc:	Mass Storage Test Context
+ *
+ * Until every block has been written once a flash device has erased
+ * blocks to spare and looks much faster than it will once full. The fill
+ * uses large stamped writes at a deep queue, on a private copy of @msc
+ * with its own buffers and engine instance.
+ */
+static int precondition(struct usb_msc_test *msc)
+{
+	struct usb_msc_test	*m;
+	struct msc_io		*io;
+	uint64_t		start;
+	unsigned		inflight = 0;
+	unsigned int		i;
+	int			events;
+	int			ret;
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	*m = *msc;
+	m->engine = msc->engine->queue ? msc->engine : &psync_engine;
+	m->size = MSC_PRECOND_SIZE;
+	if (m->size > m->psize)
+		m->size = m->psize;
+	m->iodepth = MSC_PRECOND_DEPTH;
+	m->verify_pool = 0;
+	m->slots = m->iodepth;
+	m->batch = 1;
+	m->random = false;
+	m->fill = MSC_FILL_PRNG;
+	m->base = 0;
+	m->span = m->psize;
+	m->next = 0;
+	m->rwf = 0;
+
+	ret = alloc_and_init_buffer(m);
+	if (ret < 0)
+		goto err0;
+
+	ret = engine_init(m);
+	if (ret < 0)
+		goto err1;
+
+	printf("preconditioning %s ... ", m->output);
+	fflush(stdout);
+
+	start = now_ns();
+
+	for (i = 0; i < m->slots && m->next < m->psize; i++) {
+		ret = queue_write(m, &m->ios[i], NULL, 0,
+				MIN(m->size, m->psize - m->next));
+		if (ret < 0)
+			goto err2;
+
+		inflight++;
+	}
+
+	while (inflight) {
+		ret = m->engine->commit(m);
+		if (ret < 0)
+			goto err2;
+
+		events = m->engine->getevents(m, 1, m->events, m->iodepth);
+		if (events < 0) {
+			ret = events;
+			goto err2;
+		}
+
+		for (i = 0; i < (unsigned) events; i++) {
+			io = m->events[i];
+
+			if (io->result != (int) io->len) {
+				ret = io_error(io);
+				goto err2;
+			}
+
+			inflight--;
+			io->busy = false;
+
+			if (m->next >= m->psize)
+				continue;
+
+			ret = queue_write(m, io, NULL, 0,
+					MIN(m->size, m->psize - m->next));
+			if (ret < 0)
+				goto err2;
+
+			inflight++;
+		}
+	}
+
+	printf("%.02f MB/s\n", throughput(m->psize, now_ns() - start));
+
+	/* later writes must still look newer than the fill */
+	msc->generation = m->generation;
+
+err2:
+	if (ret < 0)
+		printf("failed\n");
+	engine_exit(m);
+
+err1:
+	free_buffer(m);
+
+err0:
+	free(m);
+
+	return ret;
+}
+
+/*
+ * --steady-state, after SNIA's Solid State Storage Performance Test
+ * Specification: the workload runs in rounds until, over the last
+ * MSC_SS_WINDOW rounds, throughput stays within MSC_SS_RANGE percent of
+ * its average and the best fit line drifts less than MSC_SS_SLOPE
+ * percent of it.
+ */
+#define MSC_SS_ROUND		1000000000ULL	/* 1 s */
+#define MSC_SS_WINDOW		5
+#define MSC_SS_RANGE		20
+#define MSC_SS_SLOPE		10
+
+/* true if the MSC_SS_WINDOW rounds in @mbps, oldest first, are steady */
+static int is_steady(const double *mbps)
+{
+	double			avg = 0;
+	double			min = mbps[0];
+	double			max = mbps[0];
+	double			xm = (MSC_SS_WINDOW - 1) / 2.0;
+	double			sxy = 0;
+	double			sxx = 0;
+	unsigned int		i;
+
+	for (i = 0; i < MSC_SS_WINDOW; i++) {
+		avg += mbps[i];
+		min = MIN(min, mbps[i]);
+		max = MAX(max, mbps[i]);
+	}
+
+	avg /= MSC_SS_WINDOW;
+	if (avg <= 0)
+		return false;
+
+	for (i = 0; i < MSC_SS_WINDOW; i++) {
+		sxy += (i - xm) * (mbps[i] - avg);
+		sxx += (i - xm) * (i - xm);
+	}
+
+	if (max - min > avg * MSC_SS_RANGE / 100)
+		return false;
+
+	/* drift of the best fit line across the whole window */
+	return fabs(sxy / sxx * (MSC_SS_WINDOW - 1)) <= avg * MSC_SS_SLOPE / 100;
+}
+
+/**
+ * steady_state - run @test until its throughput settles
+ * @msc:	Mass Storage Test Context
+ * @test:	test number
+ *
+ * Nothing measured here is kept, the run proper starts from clean
+ * statistics. Gives up after --steady-state seconds and measures
+ * anyway, saying so.
+ */
+static int steady_state(struct usb_msc_test *msc, enum usb_msc_test_case test)
+{
+	double			window[MSC_SS_WINDOW];
+	double			oldest_first[MSC_SS_WINDOW];
+	int			count = msc->count;
+	uint64_t		runtime = msc->runtime;
+	int			quiet = msc->quiet;
+	struct timespec		end;
+	uint64_t		elapsed = 0;
+	unsigned		rounds = 0;
+	unsigned int		i;
+	int			steady = false;
+	int			ret;
+
+	msc->count = INT_MAX;
+	msc->runtime = MSC_SS_ROUND;
+	msc->quiet = true;
+
+	while (true) {
+		memset(&msc->read, 0x00, sizeof(msc->read));
+		memset(&msc->write, 0x00, sizeof(msc->write));
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &msc->begin);
+		ret = __do_test(msc, test);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+		if (ret < 0)
+			break;
+
+		elapsed += timespec_ns(&msc->begin, &end);
+		window[rounds++ % MSC_SS_WINDOW] = throughput(msc->read.bytes +
+				msc->write.bytes, timespec_ns(&msc->begin, &end));
+
+		if (rounds >= MSC_SS_WINDOW) {
+			for (i = 0; i < MSC_SS_WINDOW; i++)
+				oldest_first[i] = window[(rounds + i) %
+					MSC_SS_WINDOW];
+
+			steady = is_steady(oldest_first);
+			if (steady)
+				break;
+		}
+
+		if (elapsed >= msc->ss_max) {
+			fprintf(stderr, "%s: no steady state after %.0f s\n",
+					msc->output, elapsed / 1000000000.0);
+			break;
+		}
+	}
+
+	if (!quiet && steady)
+		printf("steady state after %.0f s at %.02f MB/s\n",
+				elapsed / 1000000000.0,
+				window[(rounds - 1) % MSC_SS_WINDOW]);
+
+	memset(&msc->read, 0x00, sizeof(msc->read));
+	memset(&msc->write, 0x00, sizeof(msc->write));
+	msc->transferred = 0;
+	msc->count = count;
+	msc->runtime = runtime;
+	msc->quiet = quiet;
+
+	return ret;
+}
+
+/**
+ * drop_cache - evict the slice of @msc from the page cache
+ * @msc:	Mass Storage Test Context
+ *
+ * Dirty pages are written back first, as POSIX_FADV_DONTNEED leaves
+ * them alone, and with --io-mode=mmap they are unmapped too, so that
+ * the page cache lets go of them.
+ */
+static int drop_cache(struct usb_msc_test *msc)
+{
+	uint64_t		start = msc->base &
+		~((uint64_t) getpagesize() - 1);
+	uint64_t		end = MIN(msc->base + msc->span, msc->psize);
+	int			ret;
+
+	if (msc->map) {
+		if (msync(msc->map + start, end - start, MS_SYNC) < 0 ||
+				madvise(msc->map + start, end - start,
+					MADV_DONTNEED) < 0)
+			return -errno;
+	} else if (fdatasync(msc->fd) < 0) {
+		return -errno;
+	}
+
+	ret = posix_fadvise(msc->fd, msc->base, msc->span,
+			POSIX_FADV_DONTNEED);
+
+	return -ret;
+}
+
+/**
+ * run_test - run @test and account for its duration
+ * @msc:	Mass Storage Test Context
+ * @test:	test number
+ *
+ * With --steady-state the duration and statistics only cover what
+ * happens once the device has settled.
+ */
+static int run_test(struct usb_msc_test *msc, enum usb_msc_test_case test)
+{
+	int			ret;
+
+	msc->tat = 0;
+
+	/*
+	 * whatever goes through the page cache starts out cold, and with
+	 * --steady-state stays as warm as it settled for the measured run
+	 */
+	if (!msc->direct) {
+		ret = drop_cache(msc);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (msc->ss_max) {
+		ret = steady_state(msc, test);
+		if (ret < 0)
+			return ret;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->begin);
+	ret = __do_test(msc, test);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &msc->end);
+	msc->elapsed = timespec_ns(&msc->begin, &msc->end);
+
+	return ret;
+}
+
+/**
+ * do_test - Write, Read and Verify
+ * @msc:	Mass Storage Test Context
+ * @test:	test number
+ */
+static int do_test(struct usb_msc_test *msc, enum usb_msc_test_case test)
+{
+	int			ret;
+
+	cpu_start(&msc->cpu);
+	ret = run_test(msc, test);
+	cpu_stop(&msc->cpu);
+
+	/* the last iterations may not have been drawn yet */
+	msc->reported = 0;
+	report_progress(msc, test);
+
+	if (ret < 0)
+		printf("failed\n");
+	else
+		printf("success\n");
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* --size values of the --suite runs, in KiB, 0 terminated */
+static const unsigned msc_suite_all[] = {
+	4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 0,
+};
+static const unsigned msc_suite_sg[] = {
+	4, 8, 16, 32, 64, 128, 256, 512, 1024, 0,
+};
+static const unsigned msc_suite_sg32[] = { 16, 32, 64, 0 };
+static const unsigned msc_suite_sg64[] = { 32, 64, 128, 256, 512, 1024, 0 };
+static const unsigned msc_suite_64k[] = { 64, 0 };
+
+/**
+ * struct msc_suite_case - one row of the --suite matrix
+ * @test:	test case
+ * @sizes:	--size values to run it with, KiB, 0 terminated
+ *
+ * MSC_TEST_PATTERNS runs once per pattern instead.
+ */
+struct msc_suite_case {
+	enum usb_msc_test_case	test;
+	const unsigned		*sizes;
+};
+
+static const struct msc_suite_case msc_suite[] = {
+	{ MSC_TEST_SIMPLE,		msc_suite_all, },
+	{ MSC_TEST_1SECT,		msc_suite_64k, },
+	{ MSC_TEST_8SECT,		msc_suite_64k, },
+	{ MSC_TEST_32SECT,		msc_suite_64k, },
+	{ MSC_TEST_64SECT,		msc_suite_64k, },
+	{ MSC_TEST_SG_2SECT,		msc_suite_sg, },
+	{ MSC_TEST_SG_8SECT,		msc_suite_sg, },
+	{ MSC_TEST_SG_32SECT,		msc_suite_sg32, },
+	{ MSC_TEST_SG_64SECT,		msc_suite_sg64, },
+	{ MSC_TEST_SG_128SECT,		msc_suite_64k, },
+	{ MSC_TEST_READ_PAST_LAST,	msc_suite_64k, },
+	{ MSC_TEST_LSEEK_PAST_LAST,	msc_suite_64k, },
+	{ MSC_TEST_WRITE_PAST_LAST,	msc_suite_64k, },
+	{ MSC_TEST_SG_RANDOM_READ,	msc_suite_64k, },
+	{ MSC_TEST_SG_RANDOM_WRITE,	msc_suite_64k, },
+	{ MSC_TEST_SG_RANDOM_BOTH,	msc_suite_64k, },
+	{ MSC_TEST_PATTERNS,		msc_suite_64k, },
+};
+
+/* largest --size of the suite, the buffer pool is allocated for it */
+static unsigned suite_max_size(void)
+{
+	unsigned		max = 0;
+	unsigned int		i;
+	unsigned int		j;
+
+	for (i = 0; i < ARRAY_SIZE(msc_suite); i++)
+		for (j = 0; msc_suite[i].sizes[j]; j++)
+			if (msc_suite[i].sizes[j] > max)
+				max = msc_suite[i].sizes[j];
+
+	return max * 1024;
+}
+
+/**
+ * reset_run - get @msc ready for the next run of a suite or sweep
+ * @msc:	Mass Storage Test Context
+ * @size:	--size of the run
+ * @pattern:	--pattern of the run
+ */
+static void reset_run(struct usb_msc_test *msc, unsigned size,
+		unsigned pattern)
+{
+	memset(&msc->read, 0x00, sizeof(msc->read));
+	memset(&msc->write, 0x00, sizeof(msc->write));
+	memset(&msc->discard, 0x00, sizeof(msc->discard));
+	msc->transferred = 0;
+	msc->size = size;
+	msc->pattern = pattern;
+	msc->eagain = 0;
+	msc->next = msc->base;
+}
+
+/**
+ * do_suite - run the whole test matrix in this process
+ * @msc:	Mass Storage Test Context, buffers sized by suite_max_size()
+ *
+ * This is what msc.sh used to do with one msc launch per run: the device
+ * is opened and the buffer pool allocated once for all of them. Prints
+ * one line per run and the latencies of all runs together.
+ */
+static int do_suite(struct usb_msc_test *msc)
+{
+	struct msc_stats	read;
+	struct msc_stats	write;
+	uint64_t		elapsed = 0;
+	unsigned		failed = 0;
+	unsigned		runs = 0;
+	int			quiet = msc->quiet;
+	unsigned int		i;
+	unsigned int		j;
+	int			ret;
+
+	memset(&read, 0x00, sizeof(read));
+	memset(&write, 0x00, sizeof(write));
+	msc->quiet = true;
+
+	for (i = 0; i < ARRAY_SIZE(msc_suite); i++) {
+		const struct msc_suite_case *c = &msc_suite[i];
+		const struct msc_test_desc *desc = find_test(c->test);
+		unsigned	variants = 0;
+
+		if (c->test == MSC_TEST_PATTERNS)
+			variants = ARRAY_SIZE(msc_patterns);
+		else
+			while (c->sizes[variants])
+				variants++;
+
+		for (j = 0; j < variants; j++) {
+			unsigned	pattern = 0;
+			unsigned	size;
+			char		label[8];
+
+			if (c->test == MSC_TEST_PATTERNS) {
+				size = c->sizes[0] * 1024;
+				pattern = j;
+			} else {
+				size = c->sizes[j] * 1024;
+			}
+
+			if (variants > 1)
+				snprintf(label, sizeof(label), "%d%c", c->test,
+						'a' + j);
+			else
+				snprintf(label, sizeof(label), "%d", c->test);
+
+			printf("test %-4s %-36s %5u%c ", label, desc->name,
+					size >= 1048576 ? size / 1048576 :
+					size / 1024,
+					size >= 1048576 ? 'M' : 'k');
+
+			if ((desc->flags & MSC_DESC_DEVICE) && msc->regular) {
+				printf("skipped\n");
+				continue;
+			}
+
+			reset_run(msc, size, pattern);
+			ret = run_test(msc, c->test);
+
+			printf("W %8.02f MB/s R %8.02f MB/s %s\n",
+					throughput(msc->write.bytes, msc->elapsed),
+					throughput(msc->read.bytes, msc->elapsed),
+					ret < 0 ? "FAIL" : "OK");
+
+			stats_merge(&read, &msc->read);
+			stats_merge(&write, &msc->write);
+			elapsed += msc->elapsed;
+			failed += ret < 0;
+			runs++;
+		}
+	}
+
+	msc->quiet = quiet;
+
+	printf("--------------------------------------------------------------------------------\n");
+	printf("Suite: %u of %u runs failed in %.03f s, latencies in us\n",
+			failed, runs, elapsed / 1000000000.0);
+	printf("       %9s | %8s | %8s | %8s | %8s | %8s | %8s\n",
+			"IOPS", "MB/s", "p50", "p90", "p99", "p99.9", "max");
+	printf("--------------------------------------------------------------------------------\n");
+	print_stats("Write", &write, elapsed);
+	print_stats("Read", &read, elapsed);
+
+	return failed ? -EIO : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+enum msc_format {
+	MSC_FORMAT_TEXT,
+	MSC_FORMAT_CSV,
+	MSC_FORMAT_JSON,
+};
+
+/* how long each --sweep-qd point may take to settle, in seconds */
+#define MSC_SWEEP_SETTLE	60
+
+/**
+ * struct msc_sweep - what --sweep-size, --sweep-sg and --sweep-qd go through
+ * @min_size:	smallest request size
+ * @max_size:	largest request size, the buffer pool is sized for it
+ * @min_sg:	fewest segments per request, 0 to keep the test's layout
+ * @max_sg:	most segments per request
+ * @min_qd:	shallowest queue, 0 to keep --iodepth
+ * @max_qd:	deepest queue, the buffer pool is sized for it
+ * @format:	how the curve is printed
+ *
+ * Sizes, segment counts and queue depths double from min to max.
+ */
+struct msc_sweep {
+	unsigned		min_size;
+	unsigned		max_size;
+	unsigned		min_sg;
+	unsigned		max_sg;
+	unsigned		min_qd;
+	unsigned		max_qd;
+	enum msc_format		format;
+};
+
+/**
+ * struct msc_qd_point - one point of a --sweep-qd curve
+ * @qd:		queue depth
+ * @iops:	requests per second, both directions
+ * @mbps:	throughput, both directions
+ * @p99:	the worse p99 latency of both directions, in ns
+ */
+struct msc_qd_point {
+	unsigned		qd;
+	double			iops;
+	double			mbps;
+	uint64_t		p99;
+};
+
+static void print_point_stats(enum msc_format format, const char *dir,
+		unsigned size, unsigned segments, unsigned qd,
+		struct msc_stats *st, uint64_t elapsed)
+{
+	double			iops = elapsed ? st->ios * 1000000000.0 / elapsed : 0;
+	double			mbps = throughput(st->bytes, elapsed);
+
+	switch (format) {
+	case MSC_FORMAT_CSV:
+		printf("%u,%u,%u,%s,%llu,%.0f,%.02f,%.02f,%.02f,%.02f,%.02f,%.02f\n",
+				size, segments, qd, dir,
+				(unsigned long long) st->ios, iops, mbps,
+				stats_percentile(st, 50) / 1000.0,
+				stats_percentile(st, 90) / 1000.0,
+				stats_percentile(st, 99) / 1000.0,
+				stats_percentile(st, 99.9) / 1000.0,
+				st->max / 1000.0);
+		break;
+	case MSC_FORMAT_JSON:
+		printf("\"%s\": { \"ios\": %llu, \"iops\": %.0f, \"mbps\": %.02f, \"p50_us\": %.02f, \"p90_us\": %.02f, \"p99_us\": %.02f, \"p99.9_us\": %.02f, \"max_us\": %.02f }",
+				dir, (unsigned long long) st->ios, iops, mbps,
+				stats_percentile(st, 50) / 1000.0,
+				stats_percentile(st, 90) / 1000.0,
+				stats_percentile(st, 99) / 1000.0,
+				stats_percentile(st, 99.9) / 1000.0,
+				st->max / 1000.0);
+		break;
+	default:
+		printf("%10u %4u %4u ", size, segments, qd);
+		print_stats(dir, st, elapsed);
+		break;
+	}
+}
+
+/**
+ * print_point - print one point of the sweep curve
+ * @msc:	Mass Storage Test Context, holding the run's statistics
+ * @sweep:	sweep being run
+ * @first:	true for the first point
+ * @ret:	outcome of the run
+ */
+static void print_point(struct usb_msc_test *msc, struct msc_sweep *sweep,
+		int first, int ret)
+{
+	unsigned		segments = msc->segments ? msc->segments : 1;
+	unsigned		qd = msc->iodepth;
+
+	switch (sweep->format) {
+	case MSC_FORMAT_CSV:
+		if (first)
+			printf("size,segments,qd,dir,ios,iops,mbps,p50_us,p90_us,p99_us,p99.9_us,max_us\n");
+		break;
+	case MSC_FORMAT_JSON:
+		printf("%s\n  { \"size\": %u, \"segments\": %u, \"qd\": %u, \"ok\": %s, ",
+				first ? "[" : ",", msc->size, segments, qd,
+				ret < 0 ? "false" : "true");
+		print_point_stats(sweep->format, "write", msc->size, segments,
+				qd, &msc->write, msc->elapsed);
+		printf(", ");
+		print_point_stats(sweep->format, "read", msc->size, segments,
+				qd, &msc->read, msc->elapsed);
+		printf(" }");
+		return;
+	default:
+		if (first)
+			printf("%10s %4s %4s %-6s %9s | %8s | %8s | %8s | %8s | %8s | %8s\n",
+					"size", "sg", "qd", "", "IOPS", "MB/s",
+					"p50", "p90", "p99", "p99.9", "max");
+		break;
+	}
+
+	print_point_stats(sweep->format, "write", msc->size, segments, qd,
+			&msc->write, msc->elapsed);
+	print_point_stats(sweep->format, "read", msc->size, segments, qd,
+			&msc->read, msc->elapsed);
+}
+
+/**
+ * find_knee - pick the knee of a --sweep-qd curve
+ * @curve:	points, by increasing queue depth
+ * @nr:		number of points
+ *
+ * Up to the knee a deeper queue buys throughput for little latency,
+ * past it throughput flattens out and extra requests only wait in line.
+ * The knee is where IOPS per unit of p99 latency peaks, Kleinrock's
+ * power of a queueing system.
+ */
+static const struct msc_qd_point *find_knee(const struct msc_qd_point *curve,
+		unsigned nr)
+{
+	const struct msc_qd_point *knee = NULL;
+	double			best = 0;
+	unsigned int		i;
+
+	for (i = 0; i < nr; i++) {
+		double		power;
+
+		if (!curve[i].p99)
+			continue;
+
+		power = curve[i].iops / curve[i].p99;
+		if (power > best) {
+			best = power;
+			knee = &curve[i];
+		}
+	}
+
+	return knee;
+}
+
+/**
+ * print_knee - print the knee of a --sweep-qd curve
+ * @msc:	Mass Storage Test Context, holding the curve's size and layout
+ * @sweep:	sweep being run
+ * @knee:	the knee point
+ */
+static void print_knee(struct usb_msc_test *msc, struct msc_sweep *sweep,
+		const struct msc_qd_point *knee)
+{
+	unsigned		segments = msc->segments ? msc->segments : 1;
+
+	switch (sweep->format) {
+	case MSC_FORMAT_CSV:
+		printf("%u,%u,%u,knee,,%.0f,%.02f,,,%.02f,,\n",
+				msc->size, segments, knee->qd, knee->iops,
+				knee->mbps, knee->p99 / 1000.0);
+		break;
+	case MSC_FORMAT_JSON:
+		printf(",\n  { \"size\": %u, \"segments\": %u, \"qd\": %u, \"knee\": true, \"iops\": %.0f, \"mbps\": %.02f, \"p99_us\": %.02f }",
+				msc->size, segments, knee->qd, knee->iops,
+				knee->mbps, knee->p99 / 1000.0);
+		break;
+	default:
+		printf("%10u %4u %4u %-6s %9.0f | %8.02f | %8s | %8s | %8.02f | %8s | %8s\n",
+				msc->size, segments, knee->qd, "knee",
+				knee->iops, knee->mbps, "", "",
+				knee->p99 / 1000.0, "", "");
+		break;
+	}
+}
+
+/**
+ * set_iodepth - bring the engine up again for another queue depth
+ * @msc:	Mass Storage Test Context, buffers sized for the deepest queue
+ * @iodepth:	requests to keep in flight
+ */
+static int set_iodepth(struct usb_msc_test *msc, unsigned iodepth)
+{
+	engine_exit(msc);
+	msc->iodepth = iodepth;
+
+	return engine_init(msc);
+}
+
+/**
+ * sweep_curve - run @test over the --sweep-qd depths at one size and layout
+ * @msc:	Mass Storage Test Context
+ * @test:	test case
+ * @sweep:	ranges to go through
+ * @first:	true until the first point is printed
+ *
+ * Without --sweep-qd this is a single point at --iodepth. Returns the
+ * number of failed points or negative errno.
+ */
+static int sweep_curve(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		struct msc_sweep *sweep, int *first)
+{
+	struct msc_qd_point	curve[32];
+	const struct msc_qd_point *knee;
+	unsigned		batch = msc->batch;
+	unsigned		failed = 0;
+	unsigned		nr = 0;
+	unsigned		qd = sweep->min_qd;
+	int			ret;
+
+	do {
+		if (qd) {
+			ret = set_iodepth(msc, qd);
+			if (ret < 0)
+				return ret;
+
+			msc->batch = MIN(batch, qd);
+		}
+
+		reset_run(msc, msc->size, msc->pattern);
+		ret = run_test(msc, test);
+		if (ret < 0) {
+			fprintf(stderr, "size %u, %u segments, qd %u: %s\n",
+					msc->size, msc->segments,
+					msc->iodepth, strerror(-ret));
+			failed++;
+		} else if (qd) {
+			curve[nr].qd = qd;
+			curve[nr].iops = msc->elapsed ? (msc->read.ios +
+					msc->write.ios) * 1000000000.0 /
+				msc->elapsed : 0;
+			curve[nr].mbps = throughput(msc->read.bytes +
+					msc->write.bytes, msc->elapsed);
+			curve[nr].p99 = MAX(stats_percentile(&msc->read, 99),
+					stats_percentile(&msc->write, 99));
+			nr++;
+		}
+
+		print_point(msc, sweep, *first, ret);
+		*first = false;
+
+		qd *= 2;
+	} while (qd && qd <= sweep->max_qd);
+
+	msc->batch = batch;
+
+	knee = find_knee(curve, nr);
+	if (knee)
+		print_knee(msc, sweep, knee);
+
+	return failed;
+}
+
+/**
+ * do_sweep - run @test over ranges of request sizes, segment counts and
+ *	queue depths
+ * @msc:	Mass Storage Test Context, buffers sized for @sweep->max_size
+ *		and @sweep->max_qd
+ * @test:	test case, one which moves --size bytes per request
+ * @sweep:	ranges to go through
+ *
+ * Everything runs in this process on the same buffer pool, and each run
+ * becomes one point of a throughput and latency curve.
+ */
+static int do_sweep(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		struct msc_sweep *sweep)
+{
+	const struct msc_test_desc *desc = find_test(test);
+	unsigned		failed = 0;
+	int			quiet = msc->quiet;
+	int			first = true;
+	unsigned		size;
+	unsigned		sg;
+	int			ret;
+
+	if (desc->run || desc->sectors) {
+		fprintf(stderr, "test %d doesn't use --size, can't sweep it\n",
+				test);
+		return -EINVAL;
+	}
+
+	msc->quiet = true;
+
+	for (size = sweep->min_size; size <= sweep->max_size; size *= 2) {
+		sg = sweep->min_sg;
+
+		do {
+			/* each segment holds whole sectors */
+			if (sg && (size / sg < msc->sect_size ||
+					(size / sg) % msc->sect_size))
+				break;
+
+			msc->size = size;
+			msc->segments = sg;
+			ret = sweep_curve(msc, test, sweep, &first);
+			if (ret < 0)
+				goto out;
+
+			failed += ret;
+			sg *= 2;
+		} while (sg && sg <= sweep->max_sg);
+
+		if (size > UINT_MAX / 2)
+			break;
+	}
+
+	ret = failed ? -EIO : 0;
+
+out:
+	if (sweep->format == MSC_FORMAT_JSON)
+		printf("\n]\n");
+
+	msc->segments = 0;
+	msc->quiet = quiet;
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define MSC_SLO_PROBES		10	/* rate bisection steps, at most */
+#define MSC_SLO_RESOLUTION	2	/* bisect down to this, percent */
+
+/**
+ * struct msc_slo_point - outcome of one --slo-p99 probe
+ * @qd:		queue depth
+ * @rate:	token bucket rate in bytes per second, 0 for unthrottled
+ * @mbps:	throughput, both directions
+ * @iops:	requests per second, both directions
+ * @p99:	the worse p99 latency of both directions, in ns
+ * @elapsed:	duration of the probe, in ns
+ * @read:	read statistics
+ * @write:	write statistics
+ */
+struct msc_slo_point {
+	unsigned		qd;
+	uint64_t		rate;
+	double			mbps;
+	double			iops;
+	uint64_t		p99;
+	uint64_t		elapsed;
+	struct msc_stats	read;
+	struct msc_stats	write;
+};
+
+/**
+ * slo_probe - run @test once at a given queue depth and rate
+ * @msc:	Mass Storage Test Context, buffers sized for the deepest queue
+ * @test:	test case
+ * @qd:		queue depth
+ * @rate:	bytes per second, 0 for unthrottled
+ * @point:	outcome of the run
+ */
+static int slo_probe(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		unsigned qd, uint64_t rate, struct msc_slo_point *point)
+{
+	unsigned		batch = msc->batch;
+	int			ret;
+
+	ret = set_iodepth(msc, qd);
+	if (ret < 0)
+		return ret;
+
+	msc->batch = MIN(batch, qd);
+	msc->rate_bps = rate;
+	reset_run(msc, msc->size, msc->pattern);
+	ret = run_test(msc, test);
+	msc->rate_bps = 0;
+	msc->batch = batch;
+	if (ret < 0)
+		return ret;
+
+	point->qd = qd;
+	point->rate = rate;
+	point->elapsed = msc->elapsed;
+	point->mbps = throughput(msc->read.bytes + msc->write.bytes,
+			msc->elapsed);
+	point->iops = msc->elapsed ? (msc->read.ios + msc->write.ios) *
+		1000000000.0 / msc->elapsed : 0;
+	point->p99 = MAX(stats_percentile(&msc->read, 99),
+			stats_percentile(&msc->write, 99));
+	point->read = msc->read;
+	point->write = msc->write;
+
+	return 0;
+}
+
+static void print_slo_probe(struct msc_slo_point *point, uint64_t slo)
+{
+	char			rate[16] = "-";
+
+	if (point->rate)
+		snprintf(rate, sizeof(rate), "%.02f",
+				point->rate / (1024.0 * 1024));
+
+	printf("%4u %10s | %8.02f | %9.0f | %8.02f | %s\n", point->qd, rate,
+			point->mbps, point->iops, point->p99 / 1000.0,
+			point->p99 <= slo ? "ok" : "miss");
+}
+
+/**
+ * do_slo - find the highest load which keeps p99 latency within @slo
+ * @msc:	Mass Storage Test Context, buffers sized for --iodepth
+ * @test:	test case
+ * @slo:	p99 latency target, in ns
+ *
+ * Queue depths double up to --iodepth without a rate limit first. The
+ * depth with the most throughput is kept, and if its p99 misses @slo
+ * the token bucket rate is bisected between the best load that met it
+ * and that peak. Every probe is a full run of @test.
+ */
+static int do_slo(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		uint64_t slo)
+{
+	struct msc_slo_point	*probe;
+	struct msc_slo_point	*best;
+	int			quiet = msc->quiet;
+	unsigned		max_qd = msc->iodepth;
+	unsigned		peak_qd = 1;
+	uint64_t		peak = 0;
+	uint64_t		lo = 0;
+	uint64_t		hi;
+	unsigned		qd;
+	unsigned int		i;
+	int			ret = 0;
+
+	probe = calloc(2, sizeof(*probe));
+	if (!probe)
+		return -ENOMEM;
+
+	best = probe + 1;
+	msc->quiet = true;
+
+	printf("%4s %10s | %8s | %9s | %8s |\n", "qd", "rate MB/s", "MB/s",
+			"IOPS", "p99 us");
+
+	for (qd = 1; qd && qd <= max_qd; qd *= 2) {
+		ret = slo_probe(msc, test, qd, 0, probe);
+		if (ret < 0)
+			goto out;
+
+		print_slo_probe(probe, slo);
+
+		if (probe->mbps * 1024 * 1024 > peak) {
+			peak = probe->mbps * 1024 * 1024;
+			peak_qd = qd;
+		}
+
+		if (probe->p99 <= slo && probe->mbps > best->mbps)
+			*best = *probe;
+	}
+
+	/* the unthrottled peak already meets it */
+	if (best->qd == peak_qd)
+		goto report;
+
+	lo = best->mbps * 1024 * 1024;
+	hi = peak;
+
+	for (i = 0; i < MSC_SLO_PROBES &&
+			hi - lo > hi * MSC_SLO_RESOLUTION / 100; i++) {
+		ret = slo_probe(msc, test, peak_qd, lo + (hi - lo) / 2, probe);
+		if (ret < 0)
+			goto out;
+
+		print_slo_probe(probe, slo);
+
+		if (probe->p99 > slo) {
+			hi = probe->rate;
+			continue;
+		}
+
+		lo = probe->rate;
+		if (probe->mbps > best->mbps)
+			*best = *probe;
+	}
+
+report:
+	printf("--------------------------------------------------------------------------------\n");
+
+	if (!best->qd) {
+		printf("no load met p99 < %.02f us\n", slo / 1000.0);
+		ret = -ERANGE;
+		goto out;
+	}
+
+	printf("SLO: p99 < %.02f us sustained at %.02f MB/s, %.0f IOPS, qd %u",
+			slo / 1000.0, best->mbps, best->iops, best->qd);
+	if (best->rate)
+		printf(", --rate=%.02f", best->rate / (1024.0 * 1024));
+	printf("\n");
+
+	printf("       %9s | %8s | %8s | %8s | %8s | %8s | %8s\n",
+			"IOPS", "MB/s", "p50", "p90", "p99", "p99.9", "max");
+	print_stats("Write", &best->write, best->elapsed);
+	print_stats("Read", &best->read, best->elapsed);
+	print_histogram("Write", &best->write);
+	print_histogram("Read", &best->read);
+
+out:
+	msc->quiet = quiet;
+	free(probe);
+
+	return ret;
+}
+
+/**
+ * struct msc_job - one worker of a multi-threaded run
+ * @thread:	worker thread
+ * @msc:	the worker's own test context
+ * @test:	test case to run
+ * @gate:	held by run_jobs() until every worker exists
+ * @ret:	outcome of the test case
+ */
+struct msc_job {
+	pthread_t		thread;
+	struct usb_msc_test	msc;
+	enum usb_msc_test_case	test;
+	pthread_rwlock_t	*gate;
+	int			ret;
+};
+
+static void *job_thread(void *data)
+{
+	struct msc_job		*job = data;
+
+	/* readers all get in at once, as soon as the writer lets go */
+	pthread_rwlock_rdlock(job->gate);
+	pthread_rwlock_unlock(job->gate);
+
+	job->ret = run_test(&job->msc, job->test);
+
+	/* --output: the first device done ends the run for all of them */
+	if (job->msc.stop)
+		__atomic_store_n(job->msc.stop, true, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/**
+ * merge_data - fold statistics of @src into @dst
+ * @dst:	Mass Storage Test Context collecting the aggregate
+ * @src:	Mass Storage Test Context of one job
+ */
+static void merge_data(struct usb_msc_test *dst, struct usb_msc_test *src)
+{
+	dst->transferred += src->transferred;
+	dst->eagain += src->eagain;
+	stats_merge(&dst->read, &src->read);
+	stats_merge(&dst->write, &src->write);
+	stats_merge(&dst->discard, &src->discard);
+}
+
+/**
+ * run_jobs - run every prepared worker at once and gather the results
+ * @msc:	Mass Storage Test Context, receives the aggregate statistics
+ * @job:	workers, with their test context ready to go
+ * @jobs:	number of workers
+ *
+ * Workers wait at a gate once created and are let through together,
+ * so none of them gets a head start while the others are still being
+ * spawned.
+ */
+static int run_jobs(struct usb_msc_test *msc, struct msc_job *job,
+		unsigned jobs)
+{
+	struct usb_msc_test	**src;
+	pthread_rwlock_t	gate = PTHREAD_RWLOCK_INITIALIZER;
+	unsigned int		i;
+	int			ret = 0;
+
+	src = calloc(jobs, sizeof(*src));
+	if (!src)
+		return -ENOMEM;
+
+	for (i = 0; i < jobs; i++) {
+		src[i] = &job[i].msc;
+		job[i].gate = &gate;
+	}
+
+	pthread_rwlock_wrlock(&gate);
+
+	/* before the workers exist, so that they are counted too */
+	cpu_start(&msc->cpu);
+
+	for (i = 0; i < jobs; i++) {
+		ret = pthread_create(&job[i].thread, NULL, job_thread, &job[i]);
+		if (ret) {
+			ret = -ret;
+			break;
+		}
+	}
+
+	/* a worker failed to start, the others have nothing to do */
+	if (ret < 0) {
+		jobs = i;
+		for (i = 0; i < jobs; i++)
+			job[i].msc.count = 0;
+	}
+
+	logger_attach(msc->logger, src, jobs);
+	pthread_rwlock_unlock(&gate);
+
+	for (i = 0; i < jobs; i++) {
+		pthread_join(job[i].thread, NULL);
+		if (job[i].ret < 0 && ret == 0)
+			ret = job[i].ret;
+	}
+
+	cpu_stop(&msc->cpu);
+
+	logger_attach(msc->logger, NULL, 0);
+
+	/* workers time their own run, without --steady-state warm up */
+	msc->elapsed = 0;
+	for (i = 0; i < jobs; i++) {
+		merge_data(msc, &job[i].msc);
+		msc->elapsed = MAX(msc->elapsed, job[i].msc.elapsed);
+	}
+
+	free(src);
+
+	return ret;
+}
+
+/**
+ * do_jobs - run @test on @jobs threads, each on its own slice of the device
+ * @msc:	Mass Storage Test Context, receives the aggregate statistics
+ * @test:	test number
+ * @jobs:	number of worker threads
+ * @summary:	print per-job and aggregate summary
+ *
+ * Every job gets a copy of @msc with its own buffers, engine instance and
+ * a disjoint, sector aligned LBA range. All jobs share the file
+ * descriptor, which is fine because queued engines only use positional
+ * I/O.
+ */
+static int do_jobs(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		unsigned jobs, int summary)
+{
+	struct msc_job		*job;
+	uint64_t		span;
+	unsigned int		i;
+	unsigned int		started = 0;
+	int			ret = 0;
+
+	if (!msc->engine->queue)
+		return -EINVAL;
+
+	if (find_test(test)->flags & MSC_DESC_DEVICE) {
+		fprintf(stderr, "test %d can't run with multiple jobs\n", test);
+		return -EINVAL;
+	}
+
+	span = (msc->psize / jobs) & ~((uint64_t) msc->sect_size - 1);
+	if (span < msc->size) {
+		fprintf(stderr, "device too small for %u jobs\n", jobs);
+		return -EINVAL;
+	}
+
+	ret = check_span(span, msc->size, msc->slots);
+	if (ret < 0)
+		return ret;
+
+	job = calloc(jobs, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	for (i = 0; i < jobs; i++) {
+		struct usb_msc_test	*m = &job[i].msc;
+
+		*m = *msc;
+		m->base = i * span;
+		m->span = span;
+		m->next = m->base;
+		m->quiet = true;
+		m->rate_bps = msc->rate_bps / jobs;
+		m->rate_iops = msc->rate_iops / jobs;
+		job[i].test = test;
+
+		ret = alloc_and_init_buffer(m);
+		if (ret < 0)
+			goto out;
+
+		ret = engine_init(m);
+		if (ret < 0) {
+			free_buffer(m);
+			goto out;
+		}
+
+		started++;
+	}
+
+	ret = run_jobs(msc, job, jobs);
+
+	printf("%s\n", ret < 0 ? "failed" : "success");
+
+	if (summary) {
+		for (i = 0; i < jobs; i++) {
+			struct usb_msc_test	*m = &job[i].msc;
+
+			printf("Job %2u: R %4.02f MB/s W %4.02f MB/s\n", i,
+					throughput(m->read.bytes, m->elapsed),
+					throughput(m->write.bytes, m->elapsed));
+		}
+
+		print_summary(msc, test);
+	}
+
+out:
+	for (i = 0; i < started; i++) {
+		engine_exit(&job[i].msc);
+		free_buffer(&job[i].msc);
+	}
+
+	free(job);
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define MSC_ZONE_COLUMNS	64	/* heatmap cells per row */
+
+/* darker is slower, ' ' is the fastest zone */
+static const char msc_shades[] = " .:-=+*#%@";
+
+/**
+ * struct msc_zone - outcome of one --zones zone
+ * @write:	write throughput, MB/s
+ * @read:	read throughput, MB/s
+ * @write_p99:	write p99 latency, in ns
+ * @read_p99:	read p99 latency, in ns
+ * @ret:	outcome of the zone's run
+ */
+struct msc_zone {
+	double			write;
+	double			read;
+	uint64_t		write_p99;
+	uint64_t		read_p99;
+	int			ret;
+};
+
+/**
+ * struct msc_zone_scan - a --zones scan, shared by its workers
+ * @zones:	one result per zone
+ * @nr:		number of zones
+ * @size:	bytes per zone
+ * @next:	next zone to hand out
+ * @test:	test case each zone runs
+ */
+struct msc_zone_scan {
+	struct msc_zone		*zones;
+	unsigned		nr;
+	uint64_t		size;
+	unsigned		next;
+	enum usb_msc_test_case	test;
+};
+
+/**
+ * struct msc_zone_worker - one thread of a --zones scan
+ * @thread:	worker thread
+ * @msc:	the worker's own test context
+ * @scan:	scan the worker takes zones from
+ */
+struct msc_zone_worker {
+	pthread_t		thread;
+	struct usb_msc_test	msc;
+	struct msc_zone_scan	*scan;
+};
+
+static void *zone_thread(void *data)
+{
+	struct msc_zone_worker	*w = data;
+	struct usb_msc_test	*m = &w->msc;
+	struct msc_zone_scan	*scan = w->scan;
+	struct msc_zone		*zone;
+	unsigned		z;
+
+	while ((z = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) <
+			scan->nr) {
+		zone = &scan->zones[z];
+
+		m->base = z * scan->size;
+		m->span = scan->size;
+		reset_run(m, m->size, m->pattern);
+
+		zone->ret = run_test(m, scan->test);
+		zone->write = throughput(m->write.bytes, m->elapsed);
+		zone->read = throughput(m->read.bytes, m->elapsed);
+		zone->write_p99 = stats_percentile(&m->write, 99);
+		zone->read_p99 = stats_percentile(&m->read, 99);
+	}
+
+	return NULL;
+}
+
+/* what heatmap @map shows for @zone, see print_heatmap() */
+static double zone_value(struct msc_zone *zone, unsigned map)
+{
+	switch (map) {
+	case 0:
+		return zone->write;
+	case 1:
+		return zone->read;
+	case 2:
+		return zone->write_p99 / 1000.0;
+	default:
+		return zone->read_p99 / 1000.0;
+	}
+}
+
+/**
+ * print_heatmap - print one metric of every zone as a grid of shades
+ * @scan:	finished scan
+ * @map:	0 write MB/s, 1 read MB/s, 2 write p99, 3 read p99
+ *
+ * Each cell is one zone, shaded by how far it falls behind the best
+ * zone: lower throughput or higher latency is darker. Failed zones
+ * show as 'X'.
+ */
+static void print_heatmap(struct msc_zone_scan *scan, unsigned map)
+{
+	static const char * const names[] = {
+		"Write MB/s", "Read MB/s", "Write p99 us", "Read p99 us",
+	};
+	unsigned		latency = map >= 2;
+	unsigned		levels = sizeof(msc_shades) - 2;
+	unsigned		worst_zone = 0;
+	double			best = 0;
+	double			worst = 0;
+	double			sum = 0;
+	unsigned		ok = 0;
+	unsigned int		i;
+
+	for (i = 0; i < scan->nr; i++) {
+		double		v = zone_value(&scan->zones[i], map);
+
+		if (scan->zones[i].ret < 0)
+			continue;
+
+		if (!ok || (latency ? v < best : v > best))
+			best = v;
+		if (!ok || (latency ? v > worst : v < worst)) {
+			worst = v;
+			worst_zone = i;
+		}
+
+		sum += v;
+		ok++;
+	}
+
+	if (!ok)
+		return;
+
+	printf("%s: best %.02f, average %.02f, worst %.02f in zone %u\n",
+			names[map], best, sum / ok, worst, worst_zone);
+
+	for (i = 0; i < scan->nr; i++) {
+		struct msc_zone	*zone = &scan->zones[i];
+		double		v = zone_value(zone, map);
+		double		behind = 0;
+
+		if (i % MSC_ZONE_COLUMNS == 0)
+			printf("%s%6u ", i ? "\n" : "", i);
+
+		if (zone->ret < 0) {
+			putchar('X');
+			continue;
+		}
+
+		if (latency && v > 0)
+			behind = 1 - best / v;
+		else if (!latency && best > 0)
+			behind = 1 - v / best;
+
+		putchar(msc_shades[(unsigned) (behind * levels + 0.5)]);
+	}
+
+	printf("\n\n");
+}
+
+/**
+ * do_zones - measure every zone of the device on its own
+ * @msc:	Mass Storage Test Context
+ * @test:	test case each zone runs
+ * @nr:		number of zones
+ *
+ * The device is split in @nr equal, sector aligned zones and @test runs
+ * on each of them in turn, from the zone's first sector, for --count
+ * iterations or --runtime, so throughput and latency can be told apart
+ * per LBA range. With a queue deeper than one, up to --iodepth zones are
+ * scanned at once, the depth being split between them.
+ */
+static int do_zones(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		unsigned nr)
+{
+	struct msc_zone_worker	*worker;
+	struct msc_zone_scan	scan = { 0 };
+	unsigned		workers = MIN(nr, msc->iodepth);
+	unsigned int		started = 0;
+	unsigned int		i;
+	int			ret = 0;
+
+	if (find_test(test)->flags & MSC_DESC_DEVICE) {
+		fprintf(stderr, "test %d can't run on zones\n", test);
+		return -EINVAL;
+	}
+
+	scan.nr = nr;
+	scan.test = test;
+	scan.size = (msc->psize / nr) & ~((uint64_t) msc->sect_size - 1);
+	if (scan.size < msc->size) {
+		fprintf(stderr, "device too small for %u zones\n", nr);
+		return -EINVAL;
+	}
+
+	/* the first worker gets the largest share of the queue */
+	ret = check_span(scan.size, msc->size,
+			(msc->iodepth + workers - 1) / workers +
+			msc->verify_pool);
+	if (ret < 0)
+		return ret;
+
+	scan.zones = calloc(nr, sizeof(*scan.zones));
+	if (!scan.zones)
+		return -ENOMEM;
+
+	worker = calloc(workers, sizeof(*worker));
+	if (!worker) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < workers; i++) {
+		struct usb_msc_test	*m = &worker[i].msc;
+
+		*m = *msc;
+		m->iodepth = msc->iodepth / workers +
+			(i < msc->iodepth % workers);
+		m->slots = m->iodepth + m->verify_pool;
+		m->batch = MIN(msc->batch, m->iodepth);
+		m->rate_bps = msc->rate_bps / workers;
+		m->rate_iops = msc->rate_iops / workers;
+		m->quiet = true;
+		m->logger = NULL;
+		worker[i].scan = &scan;
+
+		ret = alloc_and_init_buffer(m);
+		if (ret < 0)
+			goto out;
+
+		ret = engine_init(m);
+		if (ret < 0) {
+			free_buffer(m);
+			goto out;
+		}
+
+		started++;
+	}
+
+	printf("%u zones of %.02f MB, %u at a time\n", nr,
+			scan.size / (1024.0 * 1024), workers);
+
+	for (i = 0; i < workers; i++) {
+		ret = pthread_create(&worker[i].thread, NULL, zone_thread,
+				&worker[i]);
+		if (ret) {
+			ret = -ret;
+			break;
+		}
+	}
+
+	/* those running take over the zones of a worker which didn't start */
+	workers = i;
+	for (i = 0; i < workers; i++)
+		pthread_join(worker[i].thread, NULL);
+
+	for (i = 0; i < nr && ret == 0; i++) {
+		if (scan.zones[i].ret < 0) {
+			fprintf(stderr, "zone %u: %s\n", i,
+					strerror(-scan.zones[i].ret));
+			ret = scan.zones[i].ret;
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		print_heatmap(&scan, i);
+
+	if (msc->verbose) {
+		printf("%6s %12s | %8s | %8s | %8s | %8s\n", "zone", "LBA",
+				"W MB/s", "R MB/s", "W p99", "R p99");
+		for (i = 0; i < nr; i++) {
+			struct msc_zone	*zone = &scan.zones[i];
+
+			printf("%6u %12llu | %8.02f | %8.02f | %8.02f | %8.02f\n",
+					i, (unsigned long long)
+					(i * scan.size / msc->sect_size),
+					zone->write, zone->read,
+					zone->write_p99 / 1000.0,
+					zone->read_p99 / 1000.0);
+		}
+	}
+
+out:
+	for (i = 0; i < started; i++) {
+		engine_exit(&worker[i].msc);
+		free_buffer(&worker[i].msc);
+	}
+
+	free(worker);
+	free(scan.zones);
+
+	return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/**
+ * parse_size - parse a size with an optional k, M or G suffix
+ * @str:	string to parse
+ * @size:	parsed size, in bytes
+ */
+static int parse_size(const char *str, uint64_t *size)
+{
+	uint64_t		mult = 1;
+	char			*end;
+
+	*size = strtoull(str, &end, 10);
+	if (end == str)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		mult *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+	case 'm':
+		mult *= 1024;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		mult *= 1024;
+		break;
+	}
+
+	*size *= mult;
+
+	return 0;
+}
+
+/**
+ * parse_latency - parse a latency with an optional ns, us, ms or s suffix
+ * @str:	string to parse, microseconds without a suffix
+ * @ns:		parsed latency, in nanoseconds
+ */
+static int parse_latency(const char *str, uint64_t *ns)
+{
+	double			val;
+	char			*end;
+
+	val = strtod(str, &end);
+	if (end == str || val <= 0)
+		return -EINVAL;
+
+	if (!strcmp(end, "ns"))
+		*ns = val;
+	else if (!*end || !strcmp(end, "us"))
+		*ns = val * 1000;
+	else if (!strcmp(end, "ms"))
+		*ns = val * 1000000;
+	else if (!strcmp(end, "s"))
+		*ns = val * 1000000000;
+	else
+		return -EINVAL;
+
+	return *ns ? 0 : -EINVAL;
+}
+
+/**
+ * parse_rwf - parse a comma separated list of per-I/O flags
+ * @str:	string to parse, e.g. "hipri,nowait"
+ * @rwf:	RWF_* flags
+ */
+static int parse_rwf(const char *str, int *rwf)
+{
+	static const struct {
+		const char	*name;
+		int		flag;
+	} names[] = {
+		{ "hipri",	RWF_HIPRI, },
+		{ "dsync",	RWF_DSYNC, },
+		{ "nowait",	RWF_NOWAIT, },
+	};
+	unsigned int		i;
+	size_t			len;
+
+	*rwf = 0;
+
+	while (*str) {
+		len = strcspn(str, ",");
+
+		for (i = 0; i < ARRAY_SIZE(names); i++) {
+			if (strlen(names[i].name) == len &&
+					!strncmp(str, names[i].name, len))
+				break;
+		}
+
+		if (i == ARRAY_SIZE(names))
+			return -EINVAL;
+
+		*rwf |= names[i].flag;
+
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+
+	return 0;
+}
+
+/* MIN..MAX, or a single value */
+static int parse_range(const char *str, uint64_t *min, uint64_t *max)
+{
+	const char		*sep = strstr(str, "..");
+	int			ret;
+
+	ret = parse_size(str, min);
+	if (ret < 0)
+		return ret;
+
+	*max = *min;
+	if (sep) {
+		ret = parse_size(sep + 2, max);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!*min || *max < *min)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/**
+ * file_block_size - logical block size to use on a regular file
+ * @msc:	Mass Storage Test Context
+ * @size:	returns the block size
+ *
+ * Prefer the direct I/O alignment statx() reports, a zero there means
+ * the file system can't do direct I/O at all. Otherwise fall back to the
+ * file system block size.
+ */
+static int file_block_size(struct usb_msc_test *msc, unsigned *size)
+{
+	struct statfs		sfs;
+
+#if defined(HAVE_STATX) && defined(STATX_DIOALIGN)
+	struct statx		stx;
+
+	if (!statx(msc->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+			(stx.stx_mask & STATX_DIOALIGN)) {
+		if (!stx.stx_dio_offset_align)
+			msc->direct = false;
+		else if (stx.stx_dio_offset_align >= 512) {
+			*size = stx.stx_dio_offset_align;
+			return 0;
 		}
+	}
+#endif
+
+	if (fstatfs(msc->fd, &sfs) < 0)
+		return -errno;
+
+	*size = sfs.f_bsize;
+
+	return 0;
+}
+
+/**
+ * file_allocate - size and preallocate a regular file target
+ * @msc:	Mass Storage Test Context
+ * @size:	requested size, 0 to use the file as it is
+ */
+static int file_allocate(struct usb_msc_test *msc, uint64_t size)
+{
+	struct stat		st;
+	int			ret;
+
+	if (!size) {
+		if (fstat(msc->fd, &st) < 0)
+			return -errno;
+
+		msc->psize = st.st_size;
+		return 0;
+	}
+
+#ifdef HAVE_FALLOCATE
+	ret = fallocate(msc->fd, 0, 0, size);
+	if (ret < 0 && errno != EOPNOTSUPP)
+		return -errno;
+	if (ret < 0)
+#endif
+	{
+		/* no preallocation on this file system, sparse will do */
+		ret = ftruncate(msc->fd, size);
+		if (ret < 0)
+			return -errno;
+	}
+
+	msc->psize = size;
+
+	return 0;
+}
+
+/* not every libc's <sys/mount.h> has these yet */
+#ifndef BLKIOMIN
+#define BLKIOMIN		_IO(0x12, 120)
+#endif
+#ifndef BLKIOOPT
+#define BLKIOOPT		_IO(0x12, 121)
+#endif
+#ifndef BLKPBSZGET
+#define BLKPBSZGET		_IO(0x12, 123)
+#endif
+
+/* deepest queue picked without -q, the buffer pool grows with it */
+#define MSC_AUTO_MAX_DEPTH	64
+
+/**
+ * struct msc_limits - request geometry the kernel reports for a device
+ * @logical:	logical block size, BLKSSZGET
+ * @physical:	physical block size, BLKPBSZGET
+ * @io_min:	minimum I/O size, BLKIOMIN
+ * @io_opt:	optimal I/O size, BLKIOOPT, 0 if not reported
+ * @max_bytes:	largest request sent as is, queue/max_sectors_kb
+ * @max_segments: most segments in one request, queue/max_segments
+ * @nr_requests: requests the block layer queues, queue/nr_requests
+ * @queue_depth: commands the device takes at once, device/queue_depth,
+ *		SCSI (UAS, usb-storage) only
+ *
+ * Everything is 0 for regular files and wherever it isn't known.
+ */
+struct msc_limits {
+	unsigned	logical;
+	unsigned	physical;
+	unsigned	io_min;
+	unsigned	io_opt;
+	unsigned	max_bytes;
+	unsigned	max_segments;
+	unsigned	nr_requests;
+	unsigned	queue_depth;
+};
+
+/* read @attr of block device @dev, or of the disk when @dev is a partition */
+static int sysfs_block_attr(dev_t dev, const char *attr, unsigned *val)
+{
+	static const char * const fmt[] = {
+		"/sys/dev/block/%u:%u/%s",
+		"/sys/dev/block/%u:%u/../%s",
+	};
+	char			path[PATH_MAX];
+	unsigned int		i;
+	FILE			*f;
+	int			ret;
+
+	for (i = 0; i < ARRAY_SIZE(fmt); i++) {
+		snprintf(path, sizeof(path), fmt[i], major(dev), minor(dev),
+				attr);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		ret = fscanf(f, "%u", val);
+		fclose(f);
+
+		return ret == 1 ? 0 : -EINVAL;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * read_limits - find out which requests @path takes without splitting them
+ * @path:	device under test
+ * @lim:	limits found
+ */
+static int read_limits(const char *path, struct msc_limits *lim)
+{
+	unsigned		max_kb = 0;
+	struct stat		st;
+	int			fd;
+
+	memset(lim, 0x00, sizeof(*lim));
+
+	/* regular files are created later, they have no limits anyway */
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (ioctl(fd, BLKSSZGET, &lim->logical) < 0 ||
+			ioctl(fd, BLKPBSZGET, &lim->physical) < 0 ||
+			ioctl(fd, BLKIOMIN, &lim->io_min) < 0 ||
+			ioctl(fd, BLKIOOPT, &lim->io_opt) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	close(fd);
+
+	/* sysfs may not be mounted, just go without */
+	if (!sysfs_block_attr(st.st_rdev, "queue/max_sectors_kb", &max_kb))
+		lim->max_bytes = max_kb * 1024;
+	sysfs_block_attr(st.st_rdev, "queue/max_segments", &lim->max_segments);
+	sysfs_block_attr(st.st_rdev, "queue/nr_requests", &lim->nr_requests);
+	sysfs_block_attr(st.st_rdev, "device/queue_depth", &lim->queue_depth);
+
+	return 0;
+}
+
+static void print_limits(const char *path, struct msc_limits *lim)
+{
+	printf("%s: logical %u, physical %u, io_min %u, io_opt %u, max %u bytes in %u segments, %u requests, queue depth %u\n",
+			path, lim->logical, lim->physical, lim->io_min,
+			lim->io_opt, lim->max_bytes, lim->max_segments,
+			lim->nr_requests, lim->queue_depth);
+}
+
+/**
+ * limits_size - request size @lim suggests, 0 if there's no telling
+ * @lim:	device limits
+ * @paged:	every buffer page may become a segment
+ *
+ * The optimal I/O size if the device reports one and it goes through
+ * unsplit, otherwise the largest request the block layer passes on as
+ * is.
+ */
+static unsigned limits_size(struct msc_limits *lim, int paged)
+{
+	unsigned		max = lim->max_bytes;
+
+	if (paged && lim->max_segments)
+		max = MIN(max, lim->max_segments * (unsigned) getpagesize());
+
+	if (lim->io_opt && (!max || lim->io_opt <= max))
+		return lim->io_opt;
+
+	return max;
+}
+
+/**
+ * limits_depth - queue depth @lim suggests, 0 if there's no telling
+ * @lim:	device limits
+ *
+ * What the device itself takes, when it says, and never more than the
+ * block layer queues.
+ */
+static unsigned limits_depth(struct msc_limits *lim)
+{
+	unsigned		depth = lim->nr_requests;
+
+	if (lim->queue_depth && (!depth || lim->queue_depth < depth))
+		depth = lim->queue_depth;
+
+	return MIN(depth, MSC_AUTO_MAX_DEPTH);
+}
+
+/**
+ * check_split - warn about requests the block layer will split
+ * @path:	device under test
+ * @lim:	device limits
+ * @size:	largest request
+ * @segments:	most segments per request
+ * @direct:	O_DIRECT, where every buffer page may become a segment
+ * @hugepages:	buffer pages are physically contiguous
+ *
+ * A split request reaches the device as several commands, which no
+ * statistic collected here shows.
+ */
+static void check_split(const char *path, struct msc_limits *lim,
+		unsigned size, unsigned segments, int direct, int hugepages)
+{
+	unsigned		page = getpagesize();
+
+	if (lim->max_bytes && size > lim->max_bytes)
+		fprintf(stderr, "%s: %u byte requests are split in %u, max_sectors_kb is %u\n",
+				path, size,
+				(size + lim->max_bytes - 1) / lim->max_bytes,
+				lim->max_bytes / 1024);
+
+	if (lim->max_segments && segments > lim->max_segments)
+		fprintf(stderr, "%s: %u segments per request are split, max_segments is %u\n",
+				path, segments, lim->max_segments);
+	else if (lim->max_segments && direct && !hugepages &&
+			size / page > lim->max_segments)
+		fprintf(stderr, "%s: %u byte requests span more than %u pages and may be split, try --hugepages\n",
+				path, size, lim->max_segments);
+
+	if (lim->physical > lim->logical && size % lim->physical)
+		fprintf(stderr, "%s: %u bytes isn't a multiple of the %u byte physical block\n",
+				path, size, lim->physical);
+}
+
+/**
+ * struct msc_advice - what --advise tells the kernel about our accesses
+ * @name:	option value
+ * @fadvise:	posix_fadvise() advice, for buffered I/O
+ * @madvise:	madvise() advice, for mmap, or -1 without an equivalent
+ */
+struct msc_advice {
+	const char	*name;
+	int		fadvise;
+	int		madvise;
+};
+
+static const struct msc_advice msc_advice[] = {
+	{ "normal",	POSIX_FADV_NORMAL,	MADV_NORMAL, },
+	{ "sequential",	POSIX_FADV_SEQUENTIAL,	MADV_SEQUENTIAL, },
+	{ "random",	POSIX_FADV_RANDOM,	MADV_RANDOM, },
+	{ "willneed",	POSIX_FADV_WILLNEED,	MADV_WILLNEED, },
+	{ "noreuse",	POSIX_FADV_NOREUSE,	-1, },
+};
+
+static const struct msc_advice *find_advice(const char *name)
+{
+	unsigned int		i;
+
+	for (i = 0; i < ARRAY_SIZE(msc_advice); i++)
+		if (!strcmp(msc_advice[i].name, name))
+			return &msc_advice[i];
+
+	return NULL;
+}
+
+/**
+ * io_mode_init - set up the --io-mode of a freshly opened target
+ * @msc:	Mass Storage Test Context, sized already
+ *
+ * Buffered I/O passes --advise to posix_fadvise(), mmap maps the whole
+ * target shared and passes it to madvise().
+ */
+static int io_mode_init(struct usb_msc_test *msc)
+{
+	const struct msc_advice	*advice = msc->advice;
+	void			*map;
+	int			ret;
 
-		msc->offset = ret;
+	if (msc->io_mode == MSC_IO_BUFFERED && advice) {
+		ret = posix_fadvise(msc->fd, 0, 0, advice->fadvise);
+		if (ret)
+			return -ret;
+	}
 
-		ret = do_read(msc, 8 * msc->sect_size);
-		if (ret < 0)
-			goto err;
+	if (msc->io_mode != MSC_IO_MMAP)
+		return 0;
 
-		ret = do_verify(msc, 8 * msc->sect_size);
-		if (ret < 0)
-			goto err;
+	if (advice && advice->madvise < 0) {
+		fprintf(stderr, "--advise=%s doesn't apply to mmap\n",
+				advice->name);
+		return -EINVAL;
+	}
 
-		report_progress(msc, MSC_TEST_8SECT);
+	map = mmap(NULL, msc->psize, PROT_READ | PROT_WRITE, MAP_SHARED |
+			(msc->populate ? MAP_POPULATE : 0), msc->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	if (advice && madvise(map, msc->psize, advice->madvise) < 0) {
+		ret = -errno;
+		munmap(map, msc->psize);
+		return ret;
 	}
 
-err:
-	return ret;
+	msc->map = map;
+
+	return 0;
+}
+
+/**
+ * check_poll - find out whether --rwf=hipri requests can be polled for
+ * @msc:	Mass Storage Test Context, opened already
+ *
+ * Polling needs O_DIRECT and a block device with poll queues, for files
+ * the one holding the file system. io_uring fails every polled request
+ * without them, the other engines just don't poll.
+ */
+static int check_poll(struct usb_msc_test *msc)
+{
+	unsigned		poll = 0;
+	struct stat		st;
+
+	if (fstat(msc->fd, &st) < 0)
+		return -errno;
+
+	if (msc->direct)
+		sysfs_block_attr(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev,
+				"queue/io_poll", &poll);
+
+	if (poll)
+		return 0;
+
+	if (msc->engine == &uring_engine) {
+		fprintf(stderr, "%s: --rwf=hipri needs O_DIRECT and polled queues\n",
+				msc->output);
+		return -EOPNOTSUPP;
+	}
+
+	fprintf(stderr, "%s: no polled queues, --rwf=hipri has no effect\n",
+			msc->output);
+
+	return 0;
+}
+
+/* undo open_target() */
+static void close_target(struct usb_msc_test *msc)
+{
+	if (msc->map)
+		munmap(msc->map, msc->psize);
+
+	msc->map = NULL;
+	close(msc->fd);
 }
 
 /**
- * do_test_1sect - write/read/verify one sector at a time
+ * open_target - open the device or file under test and size it
  * @msc:	Mass Storage Test Context
+ * @flags:	open flags, O_DIRECT is dropped where it isn't supported
+ * @file_size:	regular files only, size to preallocate or 0
+ *
+ * Block devices report size and sector size through ioctls. Regular
+ * files, like g_mass_storage backing stores, are sized with fallocate()
+ * and created when @file_size is given. Undone by close_target().
  */
-static int do_test_1sect(struct usb_msc_test *msc)
+static int open_target(struct usb_msc_test *msc, int flags,
+		uint64_t file_size)
 {
-	off_t			pos;
+	struct stat		st;
+	unsigned		sect_size;
+	int			ret;
 
-	int			ret = 0;
-	int			i;
+	if (stat(msc->output, &st) < 0) {
+		if (errno != ENOENT || !file_size)
+			return -errno;
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
+		flags |= O_CREAT;
+	} else if (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: not a block device or regular file\n",
+				msc->output);
+		return -EINVAL;
 	}
 
-	msc->offset = ret;
+	msc->regular = (flags & O_CREAT) || S_ISREG(st.st_mode);
+	msc->direct = !!(flags & O_DIRECT);
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+	msc->fd = open(msc->output, flags, 0644);
+	if (msc->fd < 0 && errno == EINVAL && msc->direct) {
+		msc->direct = false;
+		msc->fd = open(msc->output, flags & ~O_DIRECT, 0644);
+	}
 
-		ret = do_write(msc, msc->sect_size);
-		if (ret < 0)
-			goto err;
+	if (msc->fd < 0)
+		return -errno;
 
-		pos = lseek(msc->fd, msc->offset - 1 * msc->sect_size,
-				SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
+	if (!msc->regular) {
+		uint64_t	blksize;
+
+		ret = ioctl(msc->fd, BLKGETSIZE64, &blksize);
+		if (ret < 0 || blksize == 0)
+			goto err_ioctl;
+
+		ret = ioctl(msc->fd, BLKSSZGET, &sect_size);
+		if (ret < 0 || sect_size == 0)
+			goto err_ioctl;
+
+		msc->psize = blksize;
+		msc->sect_size = sect_size;
+
+		goto out;
+	}
+
+	ret = file_allocate(msc, file_size);
+	if (ret < 0)
+		goto err;
+
+	ret = file_block_size(msc, &sect_size);
+	if (ret < 0)
+		goto err;
+
+	if (!msc->direct && (flags & O_DIRECT)) {
+		fprintf(stderr, "%s: no O_DIRECT support, using buffered I/O\n",
+				msc->output);
+		ret = fcntl(msc->fd, F_SETFL,
+				fcntl(msc->fd, F_GETFL) & ~O_DIRECT);
+		if (ret < 0) {
+			ret = -errno;
 			goto err;
 		}
+	}
 
-		msc->offset = ret;
+	msc->sect_size = sect_size;
+	msc->psize &= ~((uint64_t) sect_size - 1);
+	if (!msc->psize) {
+		fprintf(stderr, "%s: empty file, use --file-size\n",
+				msc->output);
+		ret = -EINVAL;
+		goto err;
+	}
 
-		ret = do_read(msc, msc->sect_size);
+out:
+	if (msc->rwf & RWF_HIPRI) {
+		ret = check_poll(msc);
 		if (ret < 0)
 			goto err;
+	}
 
-		ret = do_verify(msc, msc->sect_size);
-		if (ret < 0)
-			goto err;
+	ret = io_mode_init(msc);
+	if (ret < 0)
+		goto err;
 
-		report_progress(msc, MSC_TEST_1SECT);
-	}
+	return 0;
+
+err_ioctl:
+	ret = ret < 0 ? -errno : -EINVAL;
 
 err:
+	close(msc->fd);
+
 	return ret;
 }
 
 /**
- * do_test_simple - write/read/verify @size bytes
- * @msc:	Mass Storage Test Context
+ * do_devices - run @test on every --output at the same time
+ * @msc:	Mass Storage Test Context, opened on @outputs[0], receives
+ *		the aggregate statistics
+ * @test:	test number
+ * @outputs:	devices or files to test
+ * @nr:		number of entries in @outputs
+ * @flags:	open flags
+ * @file_size:	regular files only, size to preallocate or 0
+ * @summary:	print per-device and aggregate summary
+ *
+ * Meant for gadgets sharing a host controller. Every device gets one
+ * worker with its own copy of @msc, buffers and engine instance, and
+ * --rate applies to each of them. Workers start together and the first
+ * one done stops the others, so every number covers the same window of
+ * shared bandwidth.
  */
-static int do_test_simple(struct usb_msc_test *msc)
+static int do_devices(struct usb_msc_test *msc, enum usb_msc_test_case test,
+		char **outputs, unsigned nr, int flags, uint64_t file_size,
+		int summary)
 {
-	off_t			pos;
-
+	struct msc_job		*job;
+	double			sum = 0;
+	double			sum2 = 0;
+	unsigned int		i;
+	unsigned int		started = 0;
+	int			stop = false;
 	int			ret = 0;
-	int			i;
 
-	pos = lseek(msc->fd, 0, SEEK_CUR);
-	if (pos < 0) {
-		ret = (int) pos;
-		goto err;
-	}
+	job = calloc(nr, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		struct usb_msc_test	*m = &job[i].msc;
+
+		*m = *msc;
+		m->output = outputs[i];
+		m->quiet = true;
+		m->stop = &stop;
+		job[i].test = test;
+
+		/* the first device is already open, it's @msc's */
+		if (i) {
+			ret = open_target(m, flags, file_size);
+			if (ret < 0) {
+				fprintf(stderr, "%s: %s\n", m->output,
+						strerror(-ret));
+				goto out;
+			}
 
-	msc->offset = ret;
+			if (fsync(m->fd) < 0) {
+				ret = -errno;
+				goto err0;
+			}
+		}
 
-	for (i = 0; i < msc->count; i++) {
-		memset(msc->rxbuf, 0x00, msc->size);
+		m->span = m->psize;
 
-		ret = do_write(msc, msc->size);
-		if (ret < 0)
-			goto err;
+		if ((find_test(test)->flags & (MSC_DESC_DEVICE |
+						MSC_DESC_BLOCK)) && m->regular) {
+			fprintf(stderr, "%s: test %d needs a block device\n",
+					m->output, test);
+			ret = -EINVAL;
+			goto err0;
+		}
 
-		pos = lseek(msc->fd, msc->offset - msc->size, SEEK_SET);
-		if (pos < 0) {
-			ret = (int) pos;
-			goto err;
+		if (!(find_test(test)->flags & MSC_DESC_DEVICE)) {
+			ret = check_span(m->span, m->size, m->slots);
+			if (ret < 0)
+				goto err0;
 		}
 
-		msc->offset = ret;
+		if (m->precondition) {
+			ret = precondition(m);
+			if (ret < 0)
+				goto err0;
+		}
 
-		ret = do_read(msc, msc->size);
+		ret = alloc_and_init_buffer(m);
 		if (ret < 0)
-			goto err;
+			goto err0;
 
-		ret = do_verify(msc, msc->size);
+		ret = engine_init(m);
 		if (ret < 0)
-			goto err;
+			goto err1;
 
-		report_progress(msc, MSC_TEST_SIMPLE);
+		started++;
 	}
 
-err:
-	return ret;
-}
+	ret = run_jobs(msc, job, nr);
 
-/* ------------------------------------------------------------------------- */
+	printf("%s\n", ret < 0 ? "failed" : "success");
 
-/**
- * do_test - Write, Read and Verify
- * @msc:	Mass Storage Test Context
- * @test:	test number
- */
-static int do_test(struct usb_msc_test *msc, enum usb_msc_test_case test)
-{
-	int			ret = 0;
+	if (summary) {
+		for (i = 0; i < nr; i++) {
+			struct usb_msc_test	*m = &job[i].msc;
+			double		mbps;
 
-	switch (test) {
-	case MSC_TEST_SIMPLE:
-		ret = do_test_simple(msc);
-		break;
-	case MSC_TEST_1SECT:
-		ret = do_test_1sect(msc);
-		break;
-	case MSC_TEST_8SECT:
-		ret = do_test_8sect(msc);
-		break;
-	case MSC_TEST_32SECT:
-		ret = do_test_32sect(msc);
-		break;
-	case MSC_TEST_64SECT:
-		ret = do_test_64sect(msc);
-		break;
-	case MSC_TEST_SG_2SECT:
-		ret = do_test_sg_2sect(msc);
-		break;
-	case MSC_TEST_SG_8SECT:
-		ret = do_test_sg_8sect(msc);
-		break;
-	case MSC_TEST_SG_32SECT:
-		ret = do_test_sg_32sect(msc);
-		break;
-	case MSC_TEST_SG_64SECT:
-		ret = do_test_sg_64sect(msc);
-		break;
-	case MSC_TEST_SG_128SECT:
-		ret = do_test_sg_128sect(msc);
-		break;
-	case MSC_TEST_READ_PAST_LAST:
-		ret = do_test_read_past_last(msc);
-		break;
-	case MSC_TEST_LSEEK_PAST_LAST:
-		ret = do_test_lseek_past_last(msc);
-		break;
-	case MSC_TEST_WRITE_PAST_LAST:
-		ret = do_test_write_past_last(msc);
-		break;
-	case MSC_TEST_SG_RANDOM_READ:
-		ret = do_test_sg_random_read(msc);
-		break;
-	case MSC_TEST_SG_RANDOM_WRITE:
-		ret = do_test_sg_random_write(msc);
-		break;
-	case MSC_TEST_SG_RANDOM_BOTH:
-		ret = do_test_sg_random_both(msc);
-		break;
-	case MSC_TEST_PATTERNS:
-		ret = do_test_patterns(msc);
-		break;
-	default:
-		printf("%s: test %d is not supported\n",
-				__func__, test);
-		ret = -ENOTSUP;
+			printf("%-16s R %8.02f MB/s [p99 %8.02f us] W %8.02f MB/s [p99 %8.02f us]\n",
+					m->output,
+					throughput(m->read.bytes, m->elapsed),
+					stats_percentile(&m->read, 99) / 1000.0,
+					throughput(m->write.bytes, m->elapsed),
+					stats_percentile(&m->write, 99) / 1000.0);
+
+			mbps = throughput(m->read.bytes + m->write.bytes,
+					m->elapsed);
+			sum += mbps;
+			sum2 += mbps * mbps;
+		}
+
+		/* Jain's index: 1 when all devices get the same share */
+		printf("Fairness: %.03f\n", sum2 ? sum * sum / (nr * sum2) : 0);
+
+		print_summary(msc, test);
 	}
 
-	if (ret < 0)
-		printf("failed\n");
-	else
-		printf("success\n");
+	goto out;
+
+err1:
+	free_buffer(&job[i].msc);
+
+err0:
+	if (i)
+		close_target(&job[i].msc);
+
+out:
+	for (i = 0; i < started; i++) {
+		engine_exit(&job[i].msc);
+		free_buffer(&job[i].msc);
+		if (i)
+			close_target(&job[i].msc);
+	}
+
+	free(job);
 
 	return ret;
 }
 
-/* ------------------------------------------------------------------------- */
-
 static void usage(char *prog)
 {
 	printf("Usage: %s\n\
 			--count, -c		Iteration count\n\
 			--dsync, -n		Enables O_DSYNC\n\
-			--output, -o		Block device to write to\n\
+			--io-mode		I/O path [direct, buffered, mmap]\n\
+			--advise		Access pattern hint [normal, sequential,\n\
+						random, willneed, noreuse]\n\
+			--populate		Prefault the mmap mapping\n\
+			--msync			msync() every mmap write\n\
+			--engine, -e		I/O engine [sync, psync, io_uring, libaio]\n\
+			--iodepth, -q		Requests in flight (queued engines),\n\
+						device queue depth by default\n\
+			--jobs, -j		Worker threads, each on its own LBA range\n\
+			--batch, -B		Minimum completions reaped at once\n\
+			--verify-pool		Buffers verified on a separate thread\n\
+			--hugepages		Buffer pool backed by huge pages\n\
+			--precondition		Fill the whole target before testing\n\
+			--steady-state		Measure once throughput settles,\n\
+						waiting up to SECONDS [600]\n\
+			--discard-offset	Shift discard test ranges by BYTES\n\
+			--verify-zeroes		Read back discarded ranges\n\
+			--rwmix			Test 24 with PCT percent reads\n\
+			--read-size		Test 24 read size [--size]\n\
+			--write-size		Test 24 write size [--size]\n\
+			--rwf			Per-I/O flags [hipri, dsync, nowait],\n\
+						comma separated, hipri needs\n\
+						polled queues\n\
+			--output, -o		Block device or file to write to,\n\
+						repeat to test several at once\n\
+			--file-size		Create and preallocate a file target\n\
 			--pattern, -p		Pattern chosen\n\
-			--size, -s		Size of the internal buffers\n\
+			--size, -s		Size of the internal buffers,\n\
+						from the queue limits by default\n\
 			--summary, -S		Print summary upon completion\n\
-			--test, -t		Test number [0 - 21]\n\
-			--variance, -v		Show throughput variance\n\
+			--suite			Run the whole test matrix\n\
+			--sweep-size		Sweep request sizes, MIN..MAX, or\n\
+						auto from the queue limits\n\
+			--sweep-sg		Sweep SG segment counts, MIN..MAX,\n\
+						or auto from the queue limits\n\
+			--sweep-qd		Sweep queue depths, MIN..MAX, and\n\
+						find the knee\n\
+			--format		Sweep output [text, csv, json]\n\
+			--runtime		Run for SECONDS instead of --count\n\
+			--rate			Limit load to MB/s, or IOPS with 'iops'\n\
+			--zones			Measure N zones apart, heatmap per\n\
+						LBA range\n\
+			--slo-p99		Find the most load with p99 below\n\
+						LATENCY, at up to --iodepth\n\
+			--log			Write per-interval statistics to FILE\n\
+			--log-interval		Log interval in ms [100]\n\
+			--log-entries		Intervals kept by the log ring\n\
+			--log-dump		Print a --log FILE and exit\n\
+			--test, -t		Test number [0 - 24]\n\
+			--span			Bytes eligible for random offsets\n\
+			--distribution		Random offsets [uniform, zipf:THETA]\n\
+			--seed			Random seed\n\
+			--variance, -v		Show p99 latency while running\n\
 			--verbose, -V		Verbose output\n\
 			--help, -h		This help\n", prog);
 }
 
+/* options without a short equivalent */
+enum {
+	MSC_OPT_SPAN = 256,
+	MSC_OPT_DISTRIBUTION,
+	MSC_OPT_SEED,
+	MSC_OPT_VERIFY_POOL,
+	MSC_OPT_FILE_SIZE,
+	MSC_OPT_SUITE,
+	MSC_OPT_SWEEP_SIZE,
+	MSC_OPT_SWEEP_SG,
+	MSC_OPT_SWEEP_QD,
+	MSC_OPT_FORMAT,
+	MSC_OPT_RUNTIME,
+	MSC_OPT_RATE,
+	MSC_OPT_SLO_P99,
+	MSC_OPT_ZONES,
+	MSC_OPT_IO_MODE,
+	MSC_OPT_ADVISE,
+	MSC_OPT_POPULATE,
+	MSC_OPT_MSYNC,
+	MSC_OPT_LOG,
+	MSC_OPT_LOG_INTERVAL,
+	MSC_OPT_LOG_ENTRIES,
+	MSC_OPT_LOG_DUMP,
+	MSC_OPT_HUGEPAGES,
+	MSC_OPT_PRECONDITION,
+	MSC_OPT_STEADY_STATE,
+	MSC_OPT_DISCARD_OFFSET,
+	MSC_OPT_VERIFY_ZEROES,
+	MSC_OPT_RWMIX,
+	MSC_OPT_READ_SIZE,
+	MSC_OPT_WRITE_SIZE,
+	MSC_OPT_RWF,
+};
+
 static struct option msc_opts[] = {
 	{
-		.name		= "output",
-		.has_arg	= 1,
-		.val		= 'o',
+		.name		= "output",
+		.has_arg	= 1,
+		.val		= 'o',
+	},
+	{
+		.name		= "test",	/* test number */
+		.has_arg	= 1,
+		.val		= 't',
+	},
+	{
+		.name		= "size",	/* rx/tx buffer sizes */
+		.has_arg	= 1,
+		.val		= 's',
+	},
+	{
+		.name		= "count",	/* how many iterations */
+		.has_arg	= 1,
+		.val		= 'c',
+	},
+	{
+		.name		= "pattern",	/* chosen pattern */
+		.has_arg	= 1,
+		.val		= 'p',
+	},
+	{
+		.name		= "engine",	/* I/O engine */
+		.has_arg	= 1,
+		.val		= 'e',
+	},
+	{
+		.name		= "iodepth",	/* requests in flight */
+		.has_arg	= 1,
+		.val		= 'q',
+	},
+	{
+		.name		= "batch",	/* completions per reap */
+		.has_arg	= 1,
+		.val		= 'B',
+	},
+	{
+		.name		= "jobs",	/* worker threads */
+		.has_arg	= 1,
+		.val		= 'j',
+	},
+	{
+		.name		= "span",	/* random offset span */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SPAN,
+	},
+	{
+		.name		= "distribution", /* random offset distribution */
+		.has_arg	= 1,
+		.val		= MSC_OPT_DISTRIBUTION,
+	},
+	{
+		.name		= "seed",	/* random seed */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SEED,
+	},
+	{
+		.name		= "verify-pool", /* buffers being verified */
+		.has_arg	= 1,
+		.val		= MSC_OPT_VERIFY_POOL,
+	},
+	{
+		.name		= "hugepages",	/* huge page buffer pool */
+		.val		= MSC_OPT_HUGEPAGES,
+	},
+	{
+		.name		= "precondition", /* sequential fill first */
+		.val		= MSC_OPT_PRECONDITION,
+	},
+	{
+		.name		= "steady-state", /* settle before measuring */
+		.has_arg	= 2,
+		.val		= MSC_OPT_STEADY_STATE,
+	},
+	{
+		.name		= "discard-offset", /* misaligned discards */
+		.has_arg	= 1,
+		.val		= MSC_OPT_DISCARD_OFFSET,
+	},
+	{
+		.name		= "verify-zeroes", /* check discarded ranges */
+		.val		= MSC_OPT_VERIFY_ZEROES,
+	},
+	{
+		.name		= "rwmix",	/* percent of reads */
+		.has_arg	= 1,
+		.val		= MSC_OPT_RWMIX,
+	},
+	{
+		.name		= "read-size",	/* --rwmix read size */
+		.has_arg	= 1,
+		.val		= MSC_OPT_READ_SIZE,
+	},
+	{
+		.name		= "write-size",	/* --rwmix write size */
+		.has_arg	= 1,
+		.val		= MSC_OPT_WRITE_SIZE,
+	},
+	{
+		.name		= "rwf",	/* preadv2()/pwritev2() flags */
+		.has_arg	= 1,
+		.val		= MSC_OPT_RWF,
+	},
+	{
+		.name		= "file-size",	/* regular file target size */
+		.has_arg	= 1,
+		.val		= MSC_OPT_FILE_SIZE,
+	},
+	{
+		.name		= "suite",	/* run every test case */
+		.val		= MSC_OPT_SUITE,
+	},
+	{
+		.name		= "sweep-size",	/* request size range */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SWEEP_SIZE,
+	},
+	{
+		.name		= "sweep-sg",	/* segment count range */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SWEEP_SG,
+	},
+	{
+		.name		= "sweep-qd",	/* queue depth range */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SWEEP_QD,
+	},
+	{
+		.name		= "format",	/* sweep output format */
+		.has_arg	= 1,
+		.val		= MSC_OPT_FORMAT,
+	},
+	{
+		.name		= "runtime",	/* seconds to run for */
+		.has_arg	= 1,
+		.val		= MSC_OPT_RUNTIME,
+	},
+	{
+		.name		= "rate",	/* MB/s or IOPS ceiling */
+		.has_arg	= 1,
+		.val		= MSC_OPT_RATE,
+	},
+	{
+		.name		= "slo-p99",	/* p99 latency target */
+		.has_arg	= 1,
+		.val		= MSC_OPT_SLO_P99,
+	},
+	{
+		.name		= "zones",	/* per LBA range heatmap */
+		.has_arg	= 1,
+		.val		= MSC_OPT_ZONES,
+	},
+	{
+		.name		= "io-mode",	/* direct, buffered or mmap */
+		.has_arg	= 1,
+		.val		= MSC_OPT_IO_MODE,
+	},
+	{
+		.name		= "advise",	/* posix_fadvise()/madvise() */
+		.has_arg	= 1,
+		.val		= MSC_OPT_ADVISE,
+	},
+	{
+		.name		= "populate",	/* MAP_POPULATE */
+		.val		= MSC_OPT_POPULATE,
+	},
+	{
+		.name		= "msync",	/* msync() mmap writes */
+		.val		= MSC_OPT_MSYNC,
 	},
 	{
-		.name		= "test",	/* test number */
+		.name		= "log",	/* time series file */
 		.has_arg	= 1,
-		.val		= 't',
+		.val		= MSC_OPT_LOG,
 	},
 	{
-		.name		= "size",	/* rx/tx buffer sizes */
+		.name		= "log-interval", /* ms per log record */
 		.has_arg	= 1,
-		.val		= 's',
+		.val		= MSC_OPT_LOG_INTERVAL,
 	},
 	{
-		.name		= "count",	/* how many iterations */
+		.name		= "log-entries", /* log ring size */
 		.has_arg	= 1,
-		.val		= 'c',
+		.val		= MSC_OPT_LOG_ENTRIES,
 	},
 	{
-		.name		= "pattern",	/* chosen pattern */
+		.name		= "log-dump",	/* render a log file */
 		.has_arg	= 1,
-		.val		= 'p',
+		.val		= MSC_OPT_LOG_DUMP,
 	},
 	{
-		.name		= "variance",	/* throughput variance */
+		.name		= "variance",	/* latency spread */
 		.val		= 'v',
 	},
 	{
@@ -1691,35 +6774,85 @@ int main(int argc, char *argv[])
 {
 	struct usb_msc_test	*msc;
 
-	uint64_t		blksize;
+	const struct msc_engine	*engine = &sync_engine;
+
 	unsigned		pattern = 0;
-	unsigned		sect_size;
 	unsigned		size = 0;
-	unsigned		mult = 1;
+	struct timespec		now;
+	uint64_t		tmp_size;
+	uint64_t		span = 0;
+	uint64_t		file_size = 0;
+	uint64_t		seed = 1;
+	double			theta = 1.2;
+	enum msc_dist		dist = MSC_DIST_UNIFORM;
 	unsigned		count = 100; /* 100 loops by default */
+	unsigned		iodepth = 1;
+	unsigned		batch = 1;
+	unsigned		jobs = 1;
+	unsigned		verify_pool = 0;
+	int			hugepages = false;
+	int			precond = false;
+	double			ss_max = 0;
+	uint64_t		discard_offset = 0;
+	int			verify_zeroes = false;
+	unsigned		rwmix = 50;
+	uint64_t		read_size = 0;
+	uint64_t		write_size = 0;
+	int			rwf = 0;
 	int			flags = O_RDWR | O_DIRECT;
 	int			ret = 0;
 
 	enum usb_msc_test_case	test = MSC_TEST_SIMPLE; /* test simple */
 
 	char			*output = NULL;
-	char			*tmp;
+	char			*outputs[MSC_MAX_OUTPUTS];
+	unsigned		nr_outputs = 0;
 
 	int			variance = false;
 	int			verbose = false;
 	int			summary = false;
+	int			suite = false;
+	struct msc_sweep	sweep = { 0 };
+	uint64_t		min;
+	uint64_t		max;
+	double			runtime = 0;
+	double			rate = 0;
+	uint64_t		slo = 0;
+	unsigned		zones = 0;
+	enum msc_io_mode	io_mode = MSC_IO_DIRECT;
+	const struct msc_advice	*advice = NULL;
+	int			populate = false;
+	int			msync_writes = false;
+	int			rate_iops = false;
+	int			count_set = false;
+	int			iodepth_set = false;
+	int			auto_size = false;
+	int			auto_sg = false;
+	struct msc_limits	limits;
+	char			*end;
+	struct msc_logger	*logger = NULL;
+	char			*log_path = NULL;
+	char			*log_dump = NULL;
+	unsigned		log_interval = 100;
+	unsigned		log_entries = 36000; /* an hour of 100 ms */
 
 	while (ARRAY_SIZE(msc_opts)) {
 		int		opt_index = 0;
 		int		opt;
 
-		opt = getopt_long(argc, argv, "o:t:s:c:p:b:nvVSh", msc_opts, &opt_index);
+		opt = getopt_long(argc, argv, "o:t:s:c:p:b:e:q:B:j:nvVSh", msc_opts, &opt_index);
 		if (opt < 0)
 			break;
 
 		switch (opt) {
 		case 'o':
-			output = optarg;
+			if (nr_outputs == MSC_MAX_OUTPUTS) {
+				ret = -EINVAL;
+				goto err0;
+			}
+
+			outputs[nr_outputs++] = optarg;
+			output = outputs[0];
 			break;
 
 		case 't':
@@ -1727,39 +6860,228 @@ int main(int argc, char *argv[])
 			break;
 
 		case 's':
-			tmp = optarg;
-
-			while (isdigit(*tmp))
-				tmp++;
-
-			switch (*tmp) {
-			case 'G':
-			case 'g':
-				mult *= 1024;
-				/* FALLTHROUGH */
-			case 'M':
-			case 'm':
-				mult *= 1024;
-				/* FALLTHROUGH */
-			case 'k':
-			case 'K':
-				mult *= 1024;
+			ret = parse_size(optarg, &tmp_size);
+			if (ret < 0 || tmp_size == 0 || tmp_size > UINT_MAX) {
+				ret = -EINVAL;
+				goto err0;
+			}
+
+			size = tmp_size;
+			break;
+		case MSC_OPT_SPAN:
+			ret = parse_size(optarg, &span);
+			if (ret < 0)
+				goto err0;
+			break;
+		case MSC_OPT_DISTRIBUTION:
+			if (!strcmp(optarg, "uniform")) {
+				dist = MSC_DIST_UNIFORM;
+			} else if (!strncmp(optarg, "zipf", 4)) {
+				dist = MSC_DIST_ZIPF;
+				if (optarg[4] == ':')
+					theta = strtod(optarg + 5, NULL);
+				if (theta <= 0) {
+					ret = -EINVAL;
+					goto err0;
+				}
+			} else {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_SEED:
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case MSC_OPT_VERIFY_POOL:
+			verify_pool = atoi(optarg);
+			break;
+		case MSC_OPT_HUGEPAGES:
+			hugepages = true;
+			break;
+		case MSC_OPT_PRECONDITION:
+			precond = true;
+			break;
+		case MSC_OPT_STEADY_STATE:
+			ss_max = optarg ? strtod(optarg, NULL) : 600;
+			if (ss_max <= 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_DISCARD_OFFSET:
+			ret = parse_size(optarg, &discard_offset);
+			if (ret < 0)
+				goto err0;
+			break;
+		case MSC_OPT_VERIFY_ZEROES:
+			verify_zeroes = true;
+			break;
+		case MSC_OPT_RWMIX:
+			rwmix = strtoul(optarg, &end, 10);
+			if (*end || rwmix > 100) {
+				ret = -EINVAL;
+				goto err0;
+			}
+
+			test = MSC_TEST_RWMIX;
+			break;
+		case MSC_OPT_READ_SIZE:
+			ret = parse_size(optarg, &read_size);
+			if (ret < 0 || read_size > UINT_MAX) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_WRITE_SIZE:
+			ret = parse_size(optarg, &write_size);
+			if (ret < 0 || write_size > UINT_MAX) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_RWF:
+			ret = parse_rwf(optarg, &rwf);
+			if (ret < 0)
+				goto err0;
+			break;
+		case MSC_OPT_SUITE:
+			suite = true;
+			break;
+		case MSC_OPT_SWEEP_SIZE:
+			/* resolved once the device's limits are known */
+			if (!strcmp(optarg, "auto")) {
+				auto_size = true;
+				break;
+			}
+
+			ret = parse_range(optarg, &min, &max);
+			if (ret < 0 || max > UINT_MAX) {
+				ret = -EINVAL;
+				goto err0;
+			}
+
+			sweep.min_size = min;
+			sweep.max_size = max;
+			break;
+		case MSC_OPT_SWEEP_SG:
+			if (!strcmp(optarg, "auto")) {
+				auto_sg = true;
 				break;
 			}
-			*tmp = '\0';
 
-			size = atoi(optarg);
-			if (size == 0) {
+			ret = parse_range(optarg, &min, &max);
+			if (ret < 0 || max > MSC_MAX_SEGMENTS) {
 				ret = -EINVAL;
 				goto err0;
 			}
 
-			size *= mult;
+			sweep.min_sg = min;
+			sweep.max_sg = max;
+			break;
+		case MSC_OPT_SWEEP_QD:
+			ret = parse_range(optarg, &min, &max);
+			if (ret < 0 || !min || max > UINT_MAX) {
+				ret = -EINVAL;
+				goto err0;
+			}
+
+			sweep.min_qd = min;
+			sweep.max_qd = max;
+			break;
+		case MSC_OPT_FORMAT:
+			if (!strcmp(optarg, "text")) {
+				sweep.format = MSC_FORMAT_TEXT;
+			} else if (!strcmp(optarg, "csv")) {
+				sweep.format = MSC_FORMAT_CSV;
+			} else if (!strcmp(optarg, "json")) {
+				sweep.format = MSC_FORMAT_JSON;
+			} else {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_FILE_SIZE:
+			ret = parse_size(optarg, &file_size);
+			if (ret < 0)
+				goto err0;
 			break;
 		case 'c':
 			count = atoi(optarg);
 			if (count <= 0)
 				goto err0;
+			count_set = true;
+			break;
+		case MSC_OPT_RUNTIME:
+			runtime = strtod(optarg, NULL);
+			if (runtime <= 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_RATE:
+			rate = strtod(optarg, &end);
+			rate_iops = !strcasecmp(end, "iops");
+			if (rate <= 0 || (*end && !rate_iops)) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_SLO_P99:
+			ret = parse_latency(optarg, &slo);
+			if (ret < 0)
+				goto err0;
+			break;
+		case MSC_OPT_ZONES:
+			zones = strtoul(optarg, &end, 10);
+			if (*end || !zones) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_IO_MODE:
+			if (!strcmp(optarg, "direct")) {
+				io_mode = MSC_IO_DIRECT;
+			} else if (!strcmp(optarg, "buffered")) {
+				io_mode = MSC_IO_BUFFERED;
+			} else if (!strcmp(optarg, "mmap")) {
+				io_mode = MSC_IO_MMAP;
+			} else {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_ADVISE:
+			advice = find_advice(optarg);
+			if (!advice) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_POPULATE:
+			populate = true;
+			break;
+		case MSC_OPT_MSYNC:
+			msync_writes = true;
+			break;
+		case MSC_OPT_LOG:
+			log_path = optarg;
+			break;
+		case MSC_OPT_LOG_INTERVAL:
+			log_interval = atoi(optarg);
+			if (log_interval == 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_LOG_ENTRIES:
+			log_entries = atoi(optarg);
+			if (log_entries == 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case MSC_OPT_LOG_DUMP:
+			log_dump = optarg;
 			break;
 		case 'v':
 			variance = true;
@@ -1773,6 +7095,36 @@ int main(int argc, char *argv[])
 		case 'n':
 			flags |= O_DSYNC;
 			break;
+		case 'e':
+			engine = find_engine(optarg);
+			if (!engine) {
+				fprintf(stderr, "unknown engine '%s'\n", optarg);
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case 'q':
+			iodepth = atoi(optarg);
+			if (iodepth == 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			iodepth_set = true;
+			break;
+		case 'B':
+			batch = atoi(optarg);
+			if (batch == 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs == 0) {
+				ret = -EINVAL;
+				goto err0;
+			}
+			break;
 		case 'p':
 			pattern = atoi(optarg);
 			if (pattern > ARRAY_SIZE(msc_patterns))
@@ -1785,11 +7137,204 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (log_dump) {
+		ret = dump_log(log_dump);
+		if (ret < 0)
+			fprintf(stderr, "%s: %s\n", log_dump, strerror(-ret));
+		return ret;
+	}
+
 	if (!output) {
 		ret = -EINVAL;
 		goto err0;
 	}
 
+	/* the first target picks the defaults for all of them */
+	ret = read_limits(output, &limits);
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", output, strerror(-ret));
+		goto err0;
+	}
+
+	if (verbose && limits.logical)
+		print_limits(output, &limits);
+
+	if (auto_size) {
+		if (!limits.max_bytes) {
+			fprintf(stderr, "--sweep-size=auto needs a block device's max_sectors_kb\n");
+			ret = -EINVAL;
+			goto err0;
+		}
+
+		sweep.min_size = MAX(limits.io_min, limits.logical);
+		sweep.max_size = limits.max_bytes;
+	}
+
+	if (auto_sg) {
+		if (!limits.max_segments) {
+			fprintf(stderr, "--sweep-sg=auto needs a block device's max_segments\n");
+			ret = -EINVAL;
+			goto err0;
+		}
+
+		sweep.min_sg = 1;
+		sweep.max_sg = MIN(limits.max_segments, MSC_MAX_SEGMENTS);
+	}
+
+	if (!suite && !find_test(test)) {
+		fprintf(stderr, "test %d is not supported\n", test);
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (nr_outputs > 1 && (jobs > 1 || suite || sweep.max_size ||
+				sweep.max_sg || sweep.max_qd)) {
+		fprintf(stderr, "multiple --output run one job each, without --suite or sweeps\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (ss_max && (suite || (find_test(test)->flags & MSC_DESC_DEVICE))) {
+		fprintf(stderr, "--steady-state needs a single read/write test\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (slo && (suite || sweep.max_size || sweep.max_sg || sweep.max_qd ||
+				jobs > 1 || nr_outputs > 1 || rate ||
+				(find_test(test)->flags & MSC_DESC_DEVICE))) {
+		fprintf(stderr, "--slo-p99 sets the rate of a single read/write test\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (zones && (suite || sweep.max_size || sweep.max_sg ||
+				sweep.max_qd || slo || jobs > 1 || nr_outputs > 1)) {
+		fprintf(stderr, "--zones runs a single test on a single device\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	/* zone workers reset their statistics, the log can't add them up */
+	if (zones && log_path) {
+		fprintf(stderr, "--log doesn't work with --zones\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (suite || sweep.max_size || sweep.max_sg || sweep.max_qd) {
+		if (jobs > 1) {
+			fprintf(stderr, "--suite and sweeps run a single job\n");
+			ret = -EINVAL;
+			goto err0;
+		}
+	}
+
+	/* without --size, the largest request the device takes whole */
+	if (!size && !suite && !sweep.max_size) {
+		size = limits_size(&limits,
+				io_mode == MSC_IO_DIRECT && !hugepages);
+		if (!size) {
+			fprintf(stderr, "%s: no queue limits to pick a size from, give --size\n",
+					output);
+			ret = -EINVAL;
+			goto err0;
+		}
+
+		if (verbose)
+			printf("%s: --size %u\n", output, size);
+	}
+
+	/* slots hold the larger of both directions */
+	if (test == MSC_TEST_RWMIX) {
+		if (!read_size)
+			read_size = size;
+		if (!write_size)
+			write_size = size;
+		size = MAX(read_size, write_size);
+	}
+
+	/* one buffer pool, large enough for every run */
+	if (suite) {
+		size = suite_max_size();
+	} else if (sweep.max_size) {
+		size = sweep.max_size;
+	} else if (sweep.max_sg || sweep.max_qd) {
+		sweep.min_size = size;
+		sweep.max_size = size;
+	}
+
+	/*
+	 * jobs share the file descriptor and random offsets don't follow
+	 * it, so both need positional I/O, and so does pipelined
+	 * verification which only exists in the queued path
+	 */
+	if ((jobs > 1 || verify_pool || (!suite &&
+				(find_test(test)->flags & MSC_DESC_RANDOM))) &&
+			!engine->queue)
+		engine = &psync_engine;
+
+	/* every point settles before it's measured */
+	if (sweep.max_qd) {
+		if (!engine->queue) {
+			fprintf(stderr, "--sweep-qd needs a queued engine\n");
+			ret = -EINVAL;
+			goto err0;
+		}
+
+		iodepth = sweep.max_qd;
+		if (!ss_max)
+			ss_max = MSC_SWEEP_SETTLE;
+	}
+
+	/* as deep as the device queues, if it says */
+	if (!iodepth_set && !sweep.max_qd && engine->queue &&
+			engine != &psync_engine && limits_depth(&limits)) {
+		iodepth = limits_depth(&limits);
+		if (verbose)
+			printf("%s: --iodepth %u\n", output, iodepth);
+	}
+
+	if (io_mode == MSC_IO_MMAP && engine->queue &&
+			engine != &psync_engine) {
+		fprintf(stderr, "--io-mode=mmap runs on the sync and psync engines\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if ((populate || msync_writes) && io_mode != MSC_IO_MMAP) {
+		fprintf(stderr, "--populate and --msync need --io-mode=mmap\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (advice && io_mode == MSC_IO_DIRECT) {
+		fprintf(stderr, "--advise needs --io-mode=buffered or mmap\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	if (rwf && io_mode == MSC_IO_MMAP) {
+		fprintf(stderr, "--rwf doesn't apply to --io-mode=mmap\n");
+		ret = -EINVAL;
+		goto err0;
+	}
+
+	/* only O_DIRECT goes around the page cache */
+	if (io_mode != MSC_IO_DIRECT)
+		flags &= ~O_DIRECT;
+
+	if (!suite)
+		check_split(output, &limits, size, sweep.max_sg,
+				io_mode == MSC_IO_DIRECT, hugepages);
+
+	if (!engine->queue && iodepth > 1) {
+		fprintf(stderr, "engine '%s' only supports --iodepth=1\n",
+				engine->name);
+		ret = -EINVAL;
+		goto err0;
+	}
+
 	msc = malloc(sizeof(*msc));
 	if (!msc) {
 		ret = -ENOMEM;
@@ -1804,32 +7349,83 @@ int main(int argc, char *argv[])
 	msc->size = size;
 	msc->output = output;
 	msc->pattern = pattern;
-	msc->read_max = FLT_MIN;
-	msc->read_min = FLT_MAX;
-	msc->write_max = FLT_MIN;
-	msc->write_min = FLT_MAX;
+	msc->engine = engine;
+	msc->dist = dist;
+	msc->theta = theta;
+	msc->rnd_span = span;
+	msc->seed = seed;
+	msc->fill = MSC_FILL_PRNG;
+
+	/* with --runtime, --count only applies when given explicitly */
+	if (runtime) {
+		msc->runtime = runtime * 1000000000.0;
+		if (!count_set)
+			msc->count = INT_MAX;
+	}
 
-	ret = alloc_and_init_buffer(msc);
-	if (ret < 0)
-		goto err1;
+	if (rate_iops)
+		msc->rate_iops = rate;
+	else
+		msc->rate_bps = rate * 1024 * 1024;
+
+	/*
+	 * Generations keep growing across runs, so sectors left behind by
+	 * an earlier run always look stale.
+	 */
+	clock_gettime(CLOCK_REALTIME, &now);
+	msc->generation = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	crc32c_init();
+	prng_init();
+	msc->iodepth = iodepth;
+	msc->verify_pool = verify_pool;
+	msc->slots = iodepth + verify_pool;
+	msc->hugepages = hugepages;
+	msc->precondition = precond;
+	msc->discard_offset = discard_offset;
+	msc->verify_zeroes = verify_zeroes;
+	msc->rwmix = rwmix;
+	msc->read_size = read_size;
+	msc->write_size = write_size;
+	msc->rwf = rwf;
+	msc->io_mode = io_mode;
+	msc->advice = advice;
+	msc->populate = populate;
+	msc->msync_writes = msync_writes;
+	msc->ss_max = ss_max * 1000000000.0;
+	msc->batch = batch > iodepth ? iodepth : batch;
+
+	/* with multiple jobs, devices or zones each one allocates its own */
+	if (jobs == 1 && nr_outputs == 1 && !zones) {
+		ret = alloc_and_init_buffer(msc);
+		if (ret < 0)
+			goto err1;
+	}
 
-	msc->fd = open(output, flags);
-	if (msc->fd < 0) {
-		ret = -1;
+	ret = open_target(msc, flags, file_size);
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", output, strerror(-ret));
 		goto err2;
 	}
 
-	ret = ioctl(msc->fd, BLKGETSIZE64, &blksize);
-	if (ret < 0 || blksize == 0)
-		goto err3;
+	msc->span = msc->psize;
 
-	ret = ioctl(msc->fd, BLKSSZGET, &sect_size);
-	if (ret < 0 || sect_size == 0)
+	/* files just grow or return short reads */
+	if (!suite && (find_test(test)->flags & (MSC_DESC_DEVICE |
+					MSC_DESC_BLOCK)) &&
+			msc->regular) {
+		fprintf(stderr, "test %d needs a block device\n", test);
+		ret = -EINVAL;
 		goto err3;
+	}
 
-	msc->psize = blksize;
-	msc->pempty = blksize;
-	msc->sect_size = sect_size;
+	/* jobs, zones and devices split the target their own way */
+	if (jobs == 1 && !zones && nr_outputs == 1 && (suite ||
+				!(find_test(test)->flags & MSC_DESC_DEVICE))) {
+		ret = check_span(msc->span, msc->size, msc->slots);
+		if (ret < 0)
+			goto err3;
+	}
 
 	/*
 	 * sync before starting any test in order to get more
@@ -1839,27 +7435,100 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto err3;
 
-	ret = do_test(msc, test);
+	/* with several devices, each worker fills its own */
+	if (msc->precondition && nr_outputs == 1) {
+		ret = precondition(msc);
+		if (ret < 0)
+			goto err3;
+	}
+
+	if (log_path) {
+		logger = calloc(1, sizeof(*logger));
+		if (!logger) {
+			ret = -ENOMEM;
+			goto err3;
+		}
+
+		logger->interval = log_interval * 1000000ULL;
+		logger->entries = log_entries;
+
+		ret = logger_start(logger, log_path);
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", log_path, strerror(-ret));
+			free(logger);
+			goto err3;
+		}
+
+		msc->logger = logger;
+	}
+
+	if (nr_outputs > 1) {
+		ret = do_devices(msc, test, outputs, nr_outputs, flags,
+				file_size, summary);
+		if (ret < 0)
+			goto err3;
+
+		goto out;
+	}
+
+	if (jobs > 1) {
+		ret = do_jobs(msc, test, jobs, summary);
+		if (ret < 0)
+			goto err3;
+
+		goto out;
+	}
+
+	if (zones) {
+		ret = do_zones(msc, test, zones);
+		if (ret < 0)
+			goto err3;
+
+		goto out;
+	}
 
+	ret = engine_init(msc);
 	if (ret < 0)
 		goto err3;
 
-	if (summary)
+	logger_attach(msc->logger, &msc, 1);
+
+	if (suite)
+		ret = do_suite(msc);
+	else if (sweep.max_size)
+		ret = do_sweep(msc, test, &sweep);
+	else if (slo)
+		ret = do_slo(msc, test, slo);
+	else
+		ret = do_test(msc, test);
+
+	if (ret < 0)
+		goto err4;
+
+	if (summary && !suite && !sweep.max_size && !slo)
 		print_summary(msc, test);
 
-	close(msc->fd);
-	free(msc->txbuf);
-	free(msc->rxbuf);
+	engine_exit(msc);
+
+out:
+	logger_stop(msc->logger);
+	free(msc->logger);
+	close_target(msc);
+	free_buffer(msc);
 	free(msc);
 
 	return 0;
 
+err4:
+	engine_exit(msc);
+
 err3:
-	close(msc->fd);
+	logger_stop(msc->logger);
+	free(msc->logger);
+	close_target(msc);
 
 err2:
-	free(msc->txbuf);
-	free(msc->rxbuf);
+	free_buffer(msc);
 
 err1:
 	free(msc);